@@ -28,11 +28,37 @@ public:
   {
   }
 
+  uint8_t r() const
+  {
+    return mR;
+  }
+
+  uint8_t g() const
+  {
+    return mG;
+  }
+
+  uint8_t b() const
+  {
+    return mB;
+  }
+
   uint8_t a() const
   {
     return mA;
   }
 
+  // packed rgba value, the same for all transparent colors
+  uint32_t key() const
+  {
+    return mA ? ( uint32_t )mR | ( uint32_t )mG << 8 | ( uint32_t )mB << 16 | ( uint32_t )mA << 24 : 0;
+  }
+
+  static Color fromKey( uint32_t key )
+  {
+    return { ( uint8_t )key, ( uint8_t )( key >> 8 ), ( uint8_t )( key >> 16 ), ( uint8_t )( key >> 24 ) };
+  }
+
   uint8_t r4() const
   {
     int ret = ( mR >> 4 ) + ( ( mR & 0x08 ) >> 3 );
@@ -56,6 +82,21 @@ public:
     return ( b4() << 4 ) | r4();
   }
 
+  // opaque color of the 12-bit Lynx color this color is displayed as, its r4, g4 and b4 give the same values again
+  Color lynx() const
+  {
+    if ( !mA )
+      return {};
+
+    // the low nibble stays below 8, so it does not round up the channel again
+    auto expand = []( uint8_t c4 )
+    {
+      return ( uint8_t )( c4 << 4 | c4 >> 1 );
+    };
+
+    return { expand( r4() ), expand( g4() ), expand( b4() ), 255 };
+  }
+
   std::string str() const
   {
     static const char* hex = "0123456789ABCDEF";
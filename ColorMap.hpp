@@ -0,0 +1,134 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "Color.hpp"
+
+// Open addressing hash map from colors to values. All transparent colors share one key.
+template<typename T>
+class ColorMap
+{
+  // Transparent colors are keyed as 0, so no color ever has an alpha of 0 and non zero rgb as key
+  static constexpr uint32_t EMPTY = 0x00ffffff;
+
+  struct Slot
+  {
+    uint32_t key;
+    T value;
+  };
+
+  std::vector<Slot> mSlots;
+  size_t mSize;
+  int mShift;
+
+  size_t slot( uint32_t key ) const
+  {
+    return ( size_t )( ( key * 0x9e3779b1u ) >> mShift );
+  }
+
+  void rehash( int bits )
+  {
+    std::vector<Slot> old = std::move( mSlots );
+    mSlots.assign( size_t{ 1 } << bits, Slot{ EMPTY, T{} } );
+    mShift = 32 - bits;
+    mSize = 0;
+
+    for ( auto const& s : old )
+    {
+      if ( s.key != EMPTY )
+      {
+        insert( s.key, s.value );
+      }
+    }
+  }
+
+  T& insert( uint32_t key, T value )
+  {
+    size_t const mask = mSlots.size() - 1;
+    size_t i = slot( key );
+    while ( mSlots[i].key != EMPTY )
+    {
+      i = ( i + 1 ) & mask;
+    }
+    mSlots[i] = Slot{ key, value };
+    mSize += 1;
+    return mSlots[i].value;
+  }
+
+public:
+  ColorMap() : mSlots{}, mSize{}, mShift{}
+  {
+    rehash( 6 );
+  }
+
+  size_t size() const
+  {
+    return mSize;
+  }
+
+  // Grows the table for count colors. Copying a map in slot order into a smaller table would cluster the keys
+  void reserve( size_t count )
+  {
+    int bits = 32 - mShift;
+    while ( count * 2 > ( size_t{ 1 } << bits ) )
+    {
+      ++bits;
+    }
+    if ( bits > 32 - mShift )
+    {
+      rehash( bits );
+    }
+  }
+
+  T* find( Color c )
+  {
+    uint32_t const key = c.key();
+    size_t const mask = mSlots.size() - 1;
+    for ( size_t i = slot( key ); mSlots[i].key != EMPTY; i = ( i + 1 ) & mask )
+    {
+      if ( mSlots[i].key == key )
+        return &mSlots[i].value;
+    }
+    return nullptr;
+  }
+
+  T const* find( Color c ) const
+  {
+    return const_cast<ColorMap*>( this )->find( c );
+  }
+
+  // Returns the value stored for the color, inserting the result of fun( c ) if there is none
+  template<typename F>
+  T& findOrInsert( Color c, F const& fun )
+  {
+    if ( T* value = find( c ) )
+      return *value;
+
+    if ( ( mSize + 1 ) * 2 > mSlots.size() )
+    {
+      rehash( 33 - mShift );
+    }
+
+    return insert( c.key(), fun( c ) );
+  }
+
+  template<typename F>
+  void eachValue( F const& fun )
+  {
+    for ( auto& s : mSlots )
+    {
+      if ( s.key != EMPTY )
+        fun( s.value );
+    }
+  }
+
+  template<typename F>
+  void each( F const& fun ) const
+  {
+    for ( auto const& s : mSlots )
+    {
+      if ( s.key != EMPTY )
+        fun( Color::fromKey( s.key ), s.value );
+    }
+  }
+};
@@ -1,24 +1,95 @@
 #include "Image.hpp"
 #include "Ex.hpp"
+#include "MappedFile.hpp"
+#include "PngRowDecoder.hpp"
+#include <cassert>
+#include <fstream>
 
 #include "lodepng.h"
 
 
-Image::Image( std::filesystem::path const & path ) : mData{}, mWidth{}, mHeight{}
+Image::Image( std::filesystem::path const & path, bool streamed ) : mData{}, mIndices{}, mPalette{}, mFile{}, mRows{}, mWidth{}, mHeight{}
 {
-  uint8_t* data;
-  unsigned error = lodepng_decode32_file( &data, &mWidth, &mHeight, path.string().c_str() );
+  // the decoder reads the mapped file in place, without copying it to a buffer first
+  auto file = std::make_shared<MappedFile>( path, true );
+  auto rows = std::make_shared<PngRowDecoder>( file->data(), file->size() );
+  mWidth = rows->width();
+  mHeight = rows->height();
 
-  if ( error )
+  auto release = []( auto* p )
   {
-    throw Ex{} << "PNG decoder error " << error << ": " << lodepng_error_text( error );
+    if ( p )
+      ::free( ( void* )p );
+  };
+
+  if ( rows->indexed() && !rows->interlaced() )
+    mPalette = rows->palette();
+
+  if ( rows->interlaced() )
+  {
+    uint8_t* data;
+    unsigned error = lodepng_decode32( &data, &mWidth, &mHeight, file->data(), file->size() );
+
+    if ( error )
+    {
+      throw Ex{} << "PNG decoder error " << error << ": " << lodepng_error_text( error );
+    }
+
+    mData.reset( reinterpret_cast< Color* >( data ), release );
+  }
+  else if ( streamed )
+  {
+    mFile = std::move( file );
+    mRows = std::move( rows );
   }
+  else if ( indexed() )
+  {
+    // pixels are mapped to pens by palette index, so they are never converted to RGBA
+    uint8_t* data = ( uint8_t* )::malloc( ( size_t )mWidth * mHeight );
+    if ( !data )
+      throw Ex{} << "Not enough memory for " << mWidth << "x" << mHeight << " image";
 
-  mData.reset( reinterpret_cast< Color* >( data ), []( Color* p )
+    mIndices.reset( data, release );
+    rows->decodeIndices( [&]( int y, std::span<uint8_t const> row )
+    {
+      std::copy( row.begin(), row.end(), data + ( size_t )y * mWidth );
+    } );
+  }
+  else
   {
-    if ( p )
-      ::free( ( void* )p );
-  } );
+    // the row decoder gives the same pixels as lodepng faster
+    Color* data = ( Color* )::malloc( ( size_t )mWidth * mHeight * sizeof( Color ) );
+    if ( !data )
+      throw Ex{} << "Not enough memory for " << mWidth << "x" << mHeight << " image";
+
+    mData.reset( data, release );
+    rows->decode( [&]( int y, std::span<Color const> row )
+    {
+      std::copy( row.begin(), row.end(), data + ( size_t )y * mWidth );
+    } );
+  }
+}
+
+uint64_t Image::area( std::filesystem::path const& path )
+{
+  // pipes can't be peeked without consuming them
+  if ( !std::filesystem::is_regular_file( path ) )
+    return 0;
+
+  // signature and the IHDR chunk
+  unsigned char header[33];
+  std::ifstream fin{ path, std::ios::binary };
+  if ( !fin.read( ( char* )header, sizeof( header ) ) )
+    return 0;
+
+  unsigned width;
+  unsigned height;
+  LodePNGState state;
+  lodepng_state_init( &state );
+  unsigned error = lodepng_inspect( &width, &height, &state, header, sizeof( header ) );
+  lodepng_state_cleanup( &state );
+
+  return error ? 0 : ( uint64_t )width * height;
 }
 
 int Image::width() const
@@ -31,16 +102,57 @@ int Image::height() const
   return (int)mHeight;
 }
 
+bool Image::streamed() const
+{
+  return mRows != nullptr;
+}
+
+bool Image::indexed() const
+{
+  return !mPalette.empty();
+}
+
+std::vector<Color> const& Image::palette() const
+{
+  return mPalette;
+}
+
 Color Image::operator()( int x, int y ) const
 {
+  assert( !streamed() );
   size_t offset = y * width() + x;
   if ( offset >= mWidth * mHeight * sizeof(Color) )
   {
     return Color{};
   }
+  else if ( indexed() )
+  {
+    return mPalette[*( mIndices.get() + offset )];
+  }
   else
   {
     return *( mData.get() + offset );
   }
 }
 
+std::span<Color const> Image::pixels( int row, int begin, int end ) const
+{
+  assert( !streamed() && !indexed() && row >= 0 && row < height() && begin >= 0 && begin <= end && end <= width() );
+  return { mData.get() + ( size_t )row * mWidth + begin, ( size_t )( end - begin ) };
+}
+
+std::span<uint8_t const> Image::indices( int row, int begin, int end ) const
+{
+  assert( !streamed() && indexed() && row >= 0 && row < height() && begin >= 0 && begin <= end && end <= width() );
+  return { mIndices.get() + ( size_t )row * mWidth + begin, ( size_t )( end - begin ) };
+}
+
+void Image::decodeRows( std::function<void( int y, std::span<Color const> row )> const& fun ) const
+{
+  mRows->decode( fun );
+}
+
+void Image::decodeIndexRows( std::function<void( int y, std::span<uint8_t const> row )> const& fun ) const
+{
+  mRows->decodeIndices( fun );
+}
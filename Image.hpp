@@ -2,19 +2,43 @@
 
 #include <memory>
 #include <filesystem>
+#include <functional>
+#include <span>
+#include <vector>
 #include "Color.hpp"
 #include "ImageRow.hpp"
 
+class MappedFile;
+class PngRowDecoder;
+
 class Image : public std::enable_shared_from_this<Image>
 {
 public:
-  Image( std::filesystem::path const& path );
+  // A streamed image keeps only the mapped PNG file and decodes it again on every pass over its rows, interlaced files are decoded at once anyway.
+  // Pixels of an indexed image are kept as palette indices
+  Image( std::filesystem::path const& path, bool streamed = false );
   ~Image() = default;
 
+  // width times height read from the PNG header without decoding the image, 0 if it can't be read
+  static uint64_t area( std::filesystem::path const& path );
+
   int width() const;
   int height() const;
+  bool streamed() const;
+  bool indexed() const;
+
+  // RGBA colors of the 256 palette indices of an indexed image
+  std::vector<Color> const& palette() const;
+
+  // pixel access needs an image that is not streamed
   Color operator()( int x, int y ) const;
 
+  // contiguous pixels of the row from column begin up to column end, the image must not be indexed
+  std::span<Color const> pixels( int row, int begin, int end ) const;
+
+  // contiguous palette indices of the row from column begin up to column end of an indexed image
+  std::span<uint8_t const> indices( int row, int begin, int end ) const;
+
   ImageRow row( int row, int begin, int end ) const
   {
     return ImageRow{ *this, row, begin, end };
@@ -25,20 +49,75 @@ public:
     return row( r, 0, width() );
   }
 
+  // calls fun with the index and pixels of every row from the top
+  template<typename R>
+  void eachRow( R const& fun ) const
+  {
+    if ( streamed() )
+    {
+      decodeRows( fun );
+    }
+    else if ( indexed() )
+    {
+      std::vector<Color> colors( width() );
+      for ( int y = 0; y < height(); ++y )
+      {
+        std::span<uint8_t const> row = indices( y, 0, width() );
+        for ( size_t x = 0; x < row.size(); ++x )
+        {
+          colors[x] = mPalette[row[x]];
+        }
+        fun( y, std::span<Color const>{ colors } );
+      }
+    }
+    else
+    {
+      for ( int y = 0; y < height(); ++y )
+      {
+        fun( y, pixels( y, 0, width() ) );
+      }
+    }
+  }
+
+  // calls fun with the index and palette indices of every row of an indexed image from the top
+  template<typename R>
+  void eachIndexRow( R const& fun ) const
+  {
+    if ( streamed() )
+    {
+      decodeIndexRows( fun );
+    }
+    else
+    {
+      for ( int y = 0; y < height(); ++y )
+      {
+        fun( y, indices( y, 0, width() ) );
+      }
+    }
+  }
+
   template<typename P>
   void eachPixel( P const& fun ) const
   {
-    for ( int y = 0; y < height(); ++y )
+    eachRow( [&]( int, std::span<Color const> row )
     {
-      for ( int x = 0; x < width(); ++x )
+      for ( Color c : row )
       {
-        fun( operator()( x, y ) );
+        fun( c );
       }
-    }
+    } );
   }
 
 private:
+  void decodeRows( std::function<void( int y, std::span<Color const> row )> const& fun ) const;
+  void decodeIndexRows( std::function<void( int y, std::span<uint8_t const> row )> const& fun ) const;
+
   std::shared_ptr<Color> mData;
+  std::shared_ptr<uint8_t> mIndices;
+  // empty unless the image is indexed
+  std::vector<Color> mPalette;
+  std::shared_ptr<MappedFile> mFile;
+  std::shared_ptr<PngRowDecoder> mRows;
   uint32_t mWidth;
   uint32_t mHeight;
 };
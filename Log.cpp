@@ -18,6 +18,7 @@ void Log::log( std::string const & message )
 {
   if ( mVerbose )
   {
+    std::lock_guard<std::mutex> lock{ mMutex };
     std::cout << message;
 #ifdef _WIN32
     OutputDebugStringA( message.c_str() );
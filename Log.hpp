@@ -2,6 +2,7 @@
 
 #include <string>
 #include <sstream>
+#include <mutex>
 
 class Log
 {
@@ -16,6 +17,8 @@ public:
 private:
   Log();
   bool mVerbose = false;
+  // messages of tasks running in parallel are written whole
+  std::mutex mMutex;
 
 };
 
@@ -0,0 +1,129 @@
+#include "MappedFile.hpp"
+#include "Ex.hpp"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+MappedFile::MappedFile( std::filesystem::path const& path, bool sequential ) : mData{}, mSize{}, mBuffer{}, mFile{ INVALID_HANDLE_VALUE }, mMapping{}
+{
+  mFile = CreateFileW( path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, sequential ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_FLAG_RANDOM_ACCESS, nullptr );
+  if ( mFile == INVALID_HANDLE_VALUE )
+  {
+    throw Ex{} << "Can't open " << path;
+  }
+
+  if ( GetFileType( mFile ) != FILE_TYPE_DISK )
+  {
+    uint8_t chunk[65536];
+    DWORD read;
+    while ( ReadFile( mFile, chunk, sizeof( chunk ), &read, nullptr ) && read > 0 )
+    {
+      mBuffer.insert( mBuffer.end(), chunk, chunk + read );
+    }
+    mSize = mBuffer.size();
+    return;
+  }
+
+  LARGE_INTEGER size;
+  GetFileSizeEx( mFile, &size );
+  mSize = ( size_t )size.QuadPart;
+
+  if ( mSize > 0 )
+  {
+    mMapping = CreateFileMappingW( mFile, nullptr, PAGE_READONLY, 0, 0, nullptr );
+    mData = mMapping ? ( uint8_t const* )MapViewOfFile( mMapping, FILE_MAP_READ, 0, 0, 0 ) : nullptr;
+    if ( !mData )
+    {
+      if ( mMapping )
+        CloseHandle( mMapping );
+      CloseHandle( mFile );
+      throw Ex{} << "Can't map " << path;
+    }
+  }
+}
+
+MappedFile::~MappedFile()
+{
+  if ( mData )
+    UnmapViewOfFile( mData );
+  if ( mMapping )
+    CloseHandle( mMapping );
+  CloseHandle( mFile );
+}
+
+#else
+
+MappedFile::MappedFile( std::filesystem::path const& path, bool sequential ) : mData{}, mSize{}, mBuffer{}
+{
+  int fd = ::open( path.c_str(), O_RDONLY );
+  if ( fd < 0 )
+  {
+    throw Ex{} << "Can't open " << path;
+  }
+
+  struct stat st;
+  if ( ::fstat( fd, &st ) != 0 )
+  {
+    ::close( fd );
+    throw Ex{} << "Can't stat " << path;
+  }
+
+  if ( !S_ISREG( st.st_mode ) )
+  {
+    uint8_t chunk[65536];
+    ssize_t read;
+    while ( ( read = ::read( fd, chunk, sizeof( chunk ) ) ) > 0 )
+    {
+      mBuffer.insert( mBuffer.end(), chunk, chunk + read );
+    }
+    ::close( fd );
+
+    if ( read < 0 )
+      throw Ex{} << "Can't read " << path;
+
+    mSize = mBuffer.size();
+    return;
+  }
+
+  mSize = ( size_t )st.st_size;
+
+  if ( mSize > 0 )
+  {
+    void* data = ::mmap( nullptr, mSize, PROT_READ, MAP_PRIVATE, fd, 0 );
+    if ( data == MAP_FAILED )
+    {
+      ::close( fd );
+      throw Ex{} << "Can't map " << path;
+    }
+    ::madvise( data, mSize, sequential ? MADV_SEQUENTIAL : MADV_RANDOM );
+    mData = ( uint8_t const* )data;
+  }
+
+  ::close( fd );
+}
+
+MappedFile::~MappedFile()
+{
+  if ( mData )
+    ::munmap( ( void* )mData, mSize );
+}
+
+#endif
+
+uint8_t const* MappedFile::data() const
+{
+  return mBuffer.empty() ? mData : mBuffer.data();
+}
+
+size_t MappedFile::size() const
+{
+  return mSize;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+// Read only memory mapping of a whole file. Files that can't be mapped, like pipes, are read into memory instead
+class MappedFile
+{
+public:
+  // sequential hints the system to read ahead and drop pages behind
+  MappedFile( std::filesystem::path const& path, bool sequential = false );
+  ~MappedFile();
+  MappedFile( MappedFile const& ) = delete;
+  MappedFile& operator=( MappedFile const& ) = delete;
+
+  uint8_t const* data() const;
+  size_t size() const;
+
+private:
+  uint8_t const* mData;
+  size_t mSize;
+  std::vector<uint8_t> mBuffer;
+#ifdef _WIN32
+  void* mFile;
+  void* mMapping;
+#endif
+};
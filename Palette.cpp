@@ -2,127 +2,509 @@
 #include "Image.hpp"
 #include "Ex.hpp"
 #include "Log.hpp"
+#include "ColorMap.hpp"
+#include "Quantizer.hpp"
+#include "MappedFile.hpp"
+#include "PngRowDecoder.hpp"
+#include "ThreadPool.hpp"
 #include <cassert>
 #include <algorithm>
+#include <array>
 #include <numeric>
 #include <fstream>
 #include <iostream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <iomanip>
 
 #include "lodepng.h"
 
 namespace
 {
 
-class ColorSet
+size_t const NEAREST_TABLE_SIZE = 32 * 32 * 32;
+uint8_t const AMBIGUOUS_CELL = 0xff;
+// Lynx 12-bit colors and a bin of transparent pixels
+size_t const LYNX_BINS = 4096 + 1;
+// regroupings of palette banks before sources are left in the banks they are
+int const BANK_ITERATIONS = 16;
+
+std::vector<WeightedColor> distinctColors( Image const& src )
+{
+  std::vector<WeightedColor> colors;
+  ColorMap<size_t> index;
+
+  src.eachPixel( [&]( Color c )
+  {
+    size_t i = index.findOrInsert( c, [&]( Color c )
+    {
+      colors.push_back( WeightedColor{ Color::fromKey( c.key() ), 0 } );
+      return colors.size() - 1;
+    } );
+    colors[i].count += 1;
+  } );
+
+  return colors;
+}
+
+// Pixels of an indexed image counted by palette index without converting them to RGBA
+class IndexCounts
 {
 public:
-  ColorSet( Color c )
+  void add( std::span<uint8_t const> row )
   {
-    add( c );
+    for ( uint8_t i : row )
+    {
+      if ( mCounts[i]++ == 0 )
+        mFound.push_back( i );
+    }
   }
 
-  void add( Color c )
+  // colors with the same counts and order as distinctColors gives them
+  std::vector<WeightedColor> colors( std::vector<Color> const& palette ) const;
+
+private:
+  std::array<uint32_t, 256> mCounts{};
+  // indices in order of first appearance
+  std::vector<uint8_t> mFound;
+};
+
+std::vector<WeightedColor> IndexCounts::colors( std::vector<Color> const& palette ) const
+{
+  std::vector<WeightedColor> colors;
+  ColorMap<size_t> index;
+  for ( uint8_t i : mFound )
   {
-    if ( c )
+    size_t c = index.findOrInsert( palette[i], [&]( Color c )
     {
-      mColors.push_back( c );
-      mMeanColor = Color::mean( mColors );
-    }
+      colors.push_back( WeightedColor{ Color::fromKey( c.key() ), 0 } );
+      return colors.size() - 1;
+    } );
+    colors[c].count += mCounts[i];
   }
 
-  void merge( ColorSet const& other )
+  return colors;
+}
+
+std::vector<WeightedColor> indexedColors( PngRowDecoder const& png )
+{
+  IndexCounts counts;
+  png.decodeIndices( [&]( int, std::span<uint8_t const> row )
+  {
+    counts.add( row );
+  } );
+
+  return counts.colors( png.palette() );
+}
+
+std::vector<WeightedColor> indexedColors( Image const& src )
+{
+  IndexCounts counts;
+  src.eachIndexRow( [&]( int, std::span<uint8_t const> row )
   {
-    for ( auto c : other.mColors )
+    counts.add( row );
+  } );
+
+  return counts.colors( src.palette() );
+}
+
+size_t lynxBin( Color c )
+{
+  return c ? ( size_t )c.r4() << 8 | ( size_t )c.g4() << 4 | c.b4() : LYNX_BINS - 1;
+}
+
+// a bin is represented by the mean of its pixels
+std::vector<WeightedColor> binColors( std::vector<ColorSum> const& bins )
+{
+  std::vector<WeightedColor> colors;
+  for ( ColorSum const& bin : bins )
+  {
+    if ( bin.count > 0 )
     {
-      mColors.push_back( c );
+      colors.push_back( WeightedColor{ bin.mean(), ( uint32_t )bin.count } );
     }
-    mMeanColor = Color::mean( mColors );
   }
 
-  Color mean() const
+  return colors;
+}
+
+// Bins colors already counted, as if their pixels were binned one by one
+std::vector<ColorSum> countLynxBins( std::vector<WeightedColor> const& counted )
+{
+  std::vector<ColorSum> bins( LYNX_BINS );
+  for ( WeightedColor const& wc : counted )
+  {
+    bins[lynxBin( wc.color )].add( wc.color ? wc.color : Color{}, wc.count );
+  }
+
+  return bins;
+}
+
+// Bins pixels by the 12-bit color the Lynx would display them with, the last bin collects transparent pixels.
+// Every task counts its band of rows into its own bins.
+// Rows of a streamed image arrive in order only, so they are counted as a single band.
+std::vector<ColorSum> countLynxBins( Image const& src )
+{
+  int const height = src.height();
+  int const threads = src.streamed() ? 1 : std::clamp( height / 64, 1, ThreadPool::instance().threads() );
+  std::vector<std::vector<ColorSum>> bins( threads, std::vector<ColorSum>( LYNX_BINS ) );
+
+  auto countRow = [&]( int t, std::span<Color const> row )
   {
-    return mMeanColor;
+    for ( Color c : row )
+    {
+      bins[t][lynxBin( c )].add( c ? c : Color{}, 1 );
+    }
+  };
+
+  if ( src.streamed() )
+  {
+    src.eachRow( [&]( int, std::span<Color const> row )
+    {
+      countRow( 0, row );
+    } );
+  }
+  else
+  {
+    TaskGroup group;
+    for ( int t = 0; t < threads; ++t )
+    {
+      group.run( [&, t]
+      {
+        for ( int y = height * t / threads; y < height * ( t + 1 ) / threads; ++y )
+        {
+          countRow( t, src.pixels( y, 0, src.width() ) );
+        }
+      } );
+    }
+    group.wait();
   }
 
-private:
-  std::vector<Color> mColors = {};
-  Color mMeanColor = {};
-};
+  for ( size_t bin = 0; bin < LYNX_BINS; ++bin )
+  {
+    for ( int t = 1; t < threads; ++t )
+    {
+      bins[0][bin].add( bins[t][bin] );
+    }
+  }
 
+  return std::move( bins[0] );
 }
 
-Palette::Palette( std::filesystem::path const& path, int maxColors, std::optional<std::filesystem::path> optimalPalette ) : mColors{}
+// Distinct colors of a decoded image
+std::vector<WeightedColor> imageColors( Image const& src )
 {
-  Image src{ path };
+  return src.indexed() ? indexedColors( src ) : distinctColors( src );
+}
 
-  std::vector<ColorSet> colorSets;
+// Lynx bins of a decoded image
+std::vector<ColorSum> imageBins( Image const& src )
+{
+  return src.indexed() ? countLynxBins( indexedColors( src ) ) : countLynxBins( src );
+}
 
-  src.eachPixel( [&]( Color c )
+// Colors moved to the Lynx colors they are displayed as, counts of colors displayed the same are summed
+std::vector<WeightedColor> displayedColors( std::vector<WeightedColor> const& colors )
+{
+  std::vector<WeightedColor> result;
+  ColorMap<size_t> index;
+  for ( WeightedColor const& wc : colors )
   {
-    auto it = std::find_if( colorSets.cbegin(), colorSets.cend(), [c]( ColorSet const& cs )
+    size_t i = index.findOrInsert( wc.color.lynx(), [&]( Color c )
     {
-      return cs.mean() == c;
-    });
-    if ( it == colorSets.cend() )
-      colorSets.push_back( c );
-  } );
+      result.push_back( WeightedColor{ c, 0 } );
+      return result.size() - 1;
+    } );
+    result[i].count += wc.count;
+  }
 
-  LOG << "Palette " << path << " has " << colorSets.size() << " colors";
+  return result;
+}
 
-  if ( colorSets.size() > 256 )
+// Palette colors moved to the Lynx colors they are displayed as, only the first of colors displayed the same is kept
+std::vector<Color> displayedColors( std::vector<Color> const& colors )
+{
+  std::vector<Color> result;
+  ColorMap<bool> seen;
+  for ( Color c : colors )
   {
-    throw Ex{} << "Image " << path << " with palette hase too many (" << colorSets.size() << ") colors";
+    bool inserted = false;
+    seen.findOrInsert( c.lynx(), [&]( Color )
+    {
+      inserted = true;
+      return true;
+    } );
+    if ( inserted )
+      result.push_back( c.lynx() );
   }
 
- 
-  if ( colorSets.size() > maxColors )
+  return result;
+}
+
+// Colors of an indexed palette file counted by its palette indices, nothing if it is not a non interlaced indexed PNG.
+// Only a regular file is looked into, as a pipe can't be read twice
+std::optional<std::vector<WeightedColor>> indexedFileColors( std::filesystem::path const& path )
+{
+  if ( std::filesystem::is_regular_file( path ) )
   {
+    MappedFile file{ path, true };
+    PngRowDecoder png{ file.data(), file.size() };
+    if ( png.indexed() && !png.interlaced() )
+      return indexedColors( png );
+  }
+
+  return std::nullopt;
+}
 
-    // merge closest colors until we have maxColors
-    // O(n^3) but n is small
-    while ( colorSets.size() > maxColors )
+std::vector<WeightedColor> fileColors( std::filesystem::path const& path )
+{
+  if ( auto colors = indexedFileColors( path ) )
+    return std::move( *colors );
+
+  return imageColors( Image{ path } );
+}
+
+std::vector<ColorSum> fileBins( std::filesystem::path const& path )
+{
+  if ( auto colors = indexedFileColors( path ) )
+    return countLynxBins( *colors );
+
+  return imageBins( Image{ path } );
+}
+
+// counts every palette file on its own task
+template<typename T>
+std::vector<T> countFiles( std::vector<std::filesystem::path> const& paths, T ( *count )( std::filesystem::path const& ) )
+{
+  std::vector<T> result( paths.size() );
+  TaskGroup group;
+  for ( size_t i = 0; i < paths.size(); ++i )
+  {
+    group.run( [&, i]
     {
-      size_t si = ~0;
-      size_t sj = ~0;
-      int d = std::numeric_limits<int>::max();
+      result[i] = count( paths[i] );
+    } );
+  }
+  group.wait();
+
+  return result;
+}
+
+// Histograms of palette files counted in parallel. Histograms of several files are merged as if the files were composed into a single image:
+// counts of distinct colors are summed and Lynx bins are summed before taking their means
+class FileHistograms
+{
+public:
+  FileHistograms( std::vector<std::filesystem::path> const& paths, bool lynxBins ) : mColors{}, mBins{}
+  {
+    if ( lynxBins )
+      mBins = countFiles( paths, fileBins );
+    else
+      mColors = countFiles( paths, fileColors );
+  }
+
+  size_t size() const
+  {
+    return mBins.empty() ? mColors.size() : mBins.size();
+  }
+
+  std::vector<WeightedColor> colors( size_t file ) const
+  {
+    return mBins.empty() ? mColors[file] : binColors( mBins[file] );
+  }
 
-      for ( size_t i = 0; i < colorSets.size(); ++i )
+  std::vector<WeightedColor> merged( std::vector<size_t> const& files ) const;
+
+private:
+  std::vector<std::vector<WeightedColor>> mColors;
+  std::vector<std::vector<ColorSum>> mBins;
+};
+
+std::vector<WeightedColor> FileHistograms::merged( std::vector<size_t> const& files ) const
+{
+  if ( files.size() == 1 )
+    return colors( files[0] );
+
+  if ( !mBins.empty() )
+  {
+    std::vector<ColorSum> bins( LYNX_BINS );
+    for ( size_t bin = 0; bin < LYNX_BINS; ++bin )
+    {
+      for ( size_t file : files )
       {
-        for ( size_t j = 0; j < colorSets.size(); ++j )
-        {
-          if ( int td = dist( colorSets[i].mean(), colorSets[j].mean() ) )
-          {
-            if ( td < d )
-            {
-              d = td;
-              si = i;
-              sj = j;
-            }
-          }
-        }
+        bins[bin].add( mBins[file][bin] );
       }
+    }
 
-      assert( si != sj );
+    return binColors( bins );
+  }
 
-      size_t dst = std::min( si, sj );
-      size_t src = std::max( si, sj );
-      colorSets[dst].merge( colorSets[src] );
+  std::vector<WeightedColor> colors;
+  ColorMap<size_t> index;
+  for ( size_t file : files )
+  {
+    for ( WeightedColor const& wc : mColors[file] )
+    {
+      size_t i = index.findOrInsert( wc.color, [&]( Color c )
+      {
+        colors.push_back( WeightedColor{ Color::fromKey( c.key() ), 0 } );
+        return colors.size() - 1;
+      } );
+      colors[i].count += wc.count;
+    }
+  }
 
-      colorSets.erase( colorSets.begin() + src );
+  return colors;
+}
+
+std::vector<WeightedColor> sourceColors( std::vector<std::filesystem::path> const& paths, bool lynxBins )
+{
+  std::vector<size_t> files( paths.size() );
+  std::iota( files.begin(), files.end(), 0 );
+  return FileHistograms{ paths, lynxBins }.merged( files );
+}
+
+// Reduces counted colors to at most maxColors palette colors in palette order, with lynxColors the colors must be displayed colors already
+std::vector<Color> reduceColors( std::vector<WeightedColor> const& colors, int maxColors, Quantizer const& quantizer, int refineIterations, bool lynxColors )
+{
+  std::vector<Color> result;
+  if ( colors.size() > ( size_t )maxColors )
+  {
+    result = quantizer.reduce( colors, maxColors );
+
+    if ( refineIterations > 0 )
+      result = refineKMeans( colors, std::move( result ), refineIterations );
+
+    // means of reduced colors are not Lynx colors and may be displayed the same
+    if ( lynxColors )
+      result = displayedColors( result );
+  }
+  else
+  {
+    for ( auto const& wc : colors )
+    {
+      result.push_back( wc.color );
     }
-    LOG << "Reduced to " << maxColors << " colors";
   }
 
-  for ( auto const& cs : colorSets )
+  std::sort( result.begin(), result.end() );
+  return result;
+}
+
+// Sum of squared distances of opaque pixels to the palette colors they are mapped to
+uint64_t mappingError( std::vector<WeightedColor> const& colors, std::vector<Color> const& palette, bool lynxColors )
+{
+  uint64_t error = 0;
+  for ( WeightedColor const& wc : colors )
   {
-    mColors.push_back( cs.mean() );
+    if ( !wc.color )
+      continue;
+
+    Color const c = lynxColors ? wc.color.lynx() : wc.color;
+    int minDist = std::numeric_limits<int>::max();
+    for ( size_t i = palette[0] ? 0 : 1; i < palette.size(); ++i )
+    {
+      minDist = std::min( minDist, dist( palette[i], c ) );
+    }
+    error += ( uint64_t )minDist * wc.count;
   }
 
-  std::sort( mColors.begin(), mColors.end() );
+  return error;
+}
+
+// the single source or the number of sources
+std::string sourceName( std::vector<std::filesystem::path> const& paths )
+{
+  std::stringstream ss;
+  if ( paths.size() == 1 )
+    ss << paths[0];
+  else
+    ss << "of " << paths.size() << " images";
+
+  return ss.str();
+}
+
+// path with the bank number appended to its stem, numbers of all banks have the same width
+std::filesystem::path bankPath( std::filesystem::path const& path, size_t bank, size_t banks )
+{
+  int const width = std::snprintf( nullptr, 0, "%zu", banks - 1 );
+  std::stringstream ss;
+  ss << std::filesystem::path{ path }.replace_extension().string() << "_" << std::setfill( '0' ) << std::setw( width ) << bank << path.extension().string();
+  return ss.str();
+}
+
+// errors of mapping every source to every palette computed on parallel tasks
+std::vector<std::vector<uint64_t>> mappingErrors( std::vector<std::vector<WeightedColor>> const& sources, std::vector<std::vector<Color>> const& palettes, bool lynxColors )
+{
+  std::vector<std::vector<uint64_t>> errors( sources.size(), std::vector<uint64_t>( palettes.size() ) );
+  TaskGroup group;
+  for ( size_t i = 0; i < sources.size(); ++i )
+  {
+    group.run( [&, i]
+    {
+      for ( size_t bank = 0; bank < palettes.size(); ++bank )
+      {
+        errors[i][bank] = mappingError( sources[i], palettes[bank], lynxColors );
+      }
+    } );
+  }
+  group.wait();
+
+  return errors;
+}
+
+// bank of least error of every source, the first of banks with the same error
+std::vector<size_t> nearestBanks( std::vector<std::vector<uint64_t>> const& errors )
+{
+  std::vector<size_t> banks;
+  for ( std::vector<uint64_t> const& error : errors )
+  {
+    banks.push_back( std::distance( error.begin(), std::min_element( error.begin(), error.end() ) ) );
+  }
+
+  return banks;
+}
+
+}
+
+Palette::Palette( std::vector<std::filesystem::path> const& paths, int maxColors, Quantizer const& quantizer, int refineIterations, bool lynxBins, bool lynxColors, std::optional<std::filesystem::path> optimalPalette ) :
+  Palette{ sourceColors( paths, lynxBins ), paths, maxColors, quantizer, refineIterations, lynxBins, lynxColors, optimalPalette }
+{
+}
+
+Palette::Palette( Image const& src, std::filesystem::path const& path, int maxColors, Quantizer const& quantizer, int refineIterations, bool lynxBins, bool lynxColors, std::optional<std::filesystem::path> optimalPalette ) :
+  Palette{ lynxBins ? binColors( imageBins( src ) ) : imageColors( src ), { path }, maxColors, quantizer, refineIterations, lynxBins, lynxColors, optimalPalette }
+{
+}
+
+Palette::Palette( std::vector<WeightedColor> colors, std::vector<std::filesystem::path> const& paths, int maxColors, Quantizer const& quantizer, int refineIterations, bool lynxBins, bool lynxColors, std::optional<std::filesystem::path> optimalPalette ) :
+  mColors{}, mLynxColors{ lynxColors }
+{
+  // colors displayed the same are counted as one before reduction, so they never take two pens
+  if ( lynxColors )
+    colors = displayedColors( colors );
+
+  LOG << "Palette " << sourceName( paths ) << " has " << colors.size() << ( lynxBins || lynxColors ? " Lynx colors" : " colors" );
+
+  mColors = reduceColors( colors, maxColors, quantizer, refineIterations, lynxColors );
+  if ( colors.size() > ( size_t )maxColors )
+  {
+    LOG << "Reduced to " << mColors.size() << " colors";
+
+    if ( refineIterations > 0 )
+      LOG << "Refined with " << refineIterations << " k-means iterations";
+  }
 
   if ( optimalPalette )
   {
-    if ( !std::filesystem::exists( *optimalPalette ) || std::filesystem::last_write_time( *optimalPalette ) < std::filesystem::last_write_time( path ) )
+    auto newest = std::filesystem::file_time_type::min();
+    for ( std::filesystem::path const& path : paths )
+    {
+      newest = std::max( newest, std::filesystem::last_write_time( path ) );
+    }
+
+    if ( !std::filesystem::exists( *optimalPalette ) || std::filesystem::last_write_time( *optimalPalette ) < newest )
     {
       auto colortype = LCT_PALETTE;
       int paletteSize = std::max( 2, ( int )mColors.size() );
@@ -144,7 +526,10 @@ Palette::Palette( std::filesystem::path const& path, int maxColors, std::optiona
       state.info_raw.palettesize = 1ull << bitdepth;
       state.info_png.color.colortype = colortype;
       state.info_png.color.bitdepth = 8;
+      state.info_png.color.palette = (uint8_t*)palette.data();
       state.info_png.color.palettesize = 1ull << bitdepth;
+      // written as indexed, so the palette is read back from the PLTE chunk without converting pixels
+      state.encoder.auto_convert = 0;
 
 
       std::vector<uint8_t> indices;
@@ -154,6 +539,7 @@ Palette::Palette( std::filesystem::path const& path, int maxColors, std::optiona
       lodepng_encode( &out, &outsize, indices.data(), (uint32_t)indices.size(), 1, &state );
       error = state.error;
       state.info_raw.palette = nullptr;
+      state.info_png.color.palette = nullptr;
       lodepng_state_cleanup( &state );
 
       std::shared_ptr<uint8_t> data( out, []( uint8_t* p )
@@ -182,12 +568,31 @@ size_t Palette::size() const
   return mColors.size();
 }
 
+Palette::Palette( Palette&& ) = default;
+
+Palette::~Palette() = default;
+
 size_t Palette::mapNearest( Color src ) const
 {
   //if color is transparent -> always return index 0
   if ( !src )
     return 0;
 
+  if ( mLynxColors )
+    src = src.lynx();
+
+  if ( mTable )
+  {
+    uint8_t idx = mTable[( src.r() >> 3 ) << 10 | ( src.g() >> 3 ) << 5 | src.b() >> 3];
+    if ( idx != AMBIGUOUS_CELL )
+      return idx;
+  }
+
+  return searchNearest( src );
+}
+
+size_t Palette::searchNearest( Color src ) const
+{
   int minDist = std::numeric_limits<int>::max();
   size_t idx{};
   assert( !mColors.empty() );
@@ -203,7 +608,265 @@ size_t Palette::mapNearest( Color src ) const
   return idx;
 }
 
+// Areas of colors nearest to a palette color are convex, so a cell whose eight corners have the same nearest color has it for all its colors.
+// Other cells are marked ambiguous and their colors are searched.
+std::vector<uint8_t> Palette::buildNearestTable() const
+{
+  auto corner = []( int i )
+  {
+    return ( uint8_t )( ( i >> 1 ) * 8 + ( i & 1 ) * 7 );
+  };
+
+  std::vector<uint8_t> corners( 64 * 64 * 64 );
+  for ( int r = 0; r < 64; ++r )
+  {
+    for ( int g = 0; g < 64; ++g )
+    {
+      for ( int b = 0; b < 64; ++b )
+      {
+        corners[( r * 64 + g ) * 64 + b] = ( uint8_t )searchNearest( Color{ corner( r ), corner( g ), corner( b ), 255 } );
+      }
+    }
+  }
+
+  std::vector<uint8_t> table( NEAREST_TABLE_SIZE );
+  for ( int r = 0; r < 32; ++r )
+  {
+    for ( int g = 0; g < 32; ++g )
+    {
+      for ( int b = 0; b < 32; ++b )
+      {
+        uint8_t idx = corners[( r * 2 * 64 + g * 2 ) * 64 + b * 2];
+        for ( int i = 1; i < 8; ++i )
+        {
+          if ( corners[( ( r * 2 + ( i >> 2 ) ) * 64 + g * 2 + ( ( i >> 1 ) & 1 ) ) * 64 + b * 2 + ( i & 1 )] != idx )
+            idx = AMBIGUOUS_CELL;
+        }
+        table[r << 10 | g << 5 | b] = idx;
+      }
+    }
+  }
+
+  return table;
+}
+
+void Palette::useNearestTable( std::filesystem::path const& cacheDir )
+{
+  if ( mTable || mColors.size() >= AMBIGUOUS_CELL )
+    return;
+
+  // FNV-1a of palette colors
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for ( Color c : mColors )
+  {
+    uint32_t key = c.key();
+    for ( int i = 0; i < 4; ++i )
+    {
+      hash = ( hash ^ ( ( key >> ( i * 8 ) ) & 0xff ) ) * 0x100000001b3ull;
+    }
+  }
+
+  std::stringstream ss;
+  ss << "nearest_" << std::hex << std::setfill( '0' ) << std::setw( 16 ) << hash << ".lut";
+  std::filesystem::path const path = cacheDir / ss.str();
+
+  std::error_code ec;
+  if ( std::filesystem::file_size( path, ec ) == NEAREST_TABLE_SIZE )
+  {
+    mTableFile = std::make_unique<MappedFile>( path );
+    // a table of another palette with the same hash or a damaged file could index past the palette, so it is checked once and rebuilt if bad
+    uint8_t const* data = mTableFile->data();
+    if ( std::all_of( data, data + NEAREST_TABLE_SIZE, [&]( uint8_t idx )
+    {
+      return idx < mColors.size() || idx == AMBIGUOUS_CELL;
+    } ) )
+    {
+      mTable = data;
+      LOG << "Nearest color table mapped from " << path;
+      return;
+    }
+    mTableFile.reset();
+    LOG << "Nearest color table in " << path << " is invalid, rebuilding";
+  }
+
+  mTableData = buildNearestTable();
+  mTable = mTableData.data();
+
+  // written under a temporary name and renamed, so concurrent processes never map a partial table
+  std::filesystem::path temp = path;
+  temp += "." + std::to_string( std::random_device{}() ) + ".tmp";
+  std::filesystem::create_directories( cacheDir, ec );
+  {
+    std::ofstream fout{ temp, std::ios::binary };
+    fout.write( ( char const* )mTableData.data(), mTableData.size() );
+  }
+  std::filesystem::rename( temp, path, ec );
+  if ( ec )
+  {
+    std::filesystem::remove( temp, ec );
+    LOG << "Nearest color table can't be saved to " << path;
+  }
+  else
+  {
+    LOG << "Nearest color table saved to " << path;
+  }
+}
+
 std::vector<Color> const & Palette::colors() const
 {
   return mColors;
 }
+
+// Banks are seeded by the source with the most pixels and then by the source mapped worst to the palettes so far, like k-means++ without chance.
+// Then sources are repeatedly moved to the bank of least error and palettes are reduced again from the merged colors of their banks, until no source moves
+PaletteBanks::PaletteBanks( std::vector<std::filesystem::path> const& paths, int banks, int maxColors, Quantizer const& quantizer, int refineIterations, bool lynxBins, bool lynxColors, std::optional<std::filesystem::path> optimalPalette ) :
+  mPalettes{}, mBanks{}, mLynxBins{ lynxBins }, mLynxColors{ lynxColors }
+{
+  assert( banks > 0 && !paths.empty() );
+
+  FileHistograms const histograms{ paths, lynxBins };
+  std::vector<std::vector<WeightedColor>> sources;
+  std::vector<uint64_t> pixels;
+  for ( size_t i = 0; i < histograms.size(); ++i )
+  {
+    sources.push_back( histograms.colors( i ) );
+    pixels.push_back( std::accumulate( sources[i].begin(), sources[i].end(), uint64_t{}, []( uint64_t sum, WeightedColor const& wc )
+    {
+      return sum + wc.count;
+    } ) );
+  }
+
+  auto reduce = [&]( std::vector<size_t> const& members )
+  {
+    std::vector<WeightedColor> colors = histograms.merged( members );
+    return reduceColors( lynxColors ? displayedColors( colors ) : colors, maxColors, quantizer, refineIterations, lynxColors );
+  };
+
+  std::vector<std::vector<Color>> palettes;
+  std::vector<std::vector<size_t>> members;
+  std::vector<uint64_t> worst( sources.size(), std::numeric_limits<uint64_t>::max() );
+  size_t seed = std::distance( pixels.begin(), std::max_element( pixels.begin(), pixels.end() ) );
+  for ( ;; )
+  {
+    members.push_back( { seed } );
+    palettes.push_back( reduce( members.back() ) );
+    if ( palettes.size() == ( size_t )banks )
+      break;
+
+    std::vector<std::vector<uint64_t>> errors = mappingErrors( sources, { palettes.back() }, lynxColors );
+    for ( size_t i = 0; i < sources.size(); ++i )
+    {
+      worst[i] = std::min( worst[i], errors[i][0] );
+    }
+    // a source seeds one bank at most
+    worst[seed] = 0;
+
+    seed = std::distance( worst.begin(), std::max_element( worst.begin(), worst.end() ) );
+    // every source is mapped exactly already
+    if ( worst[seed] == 0 )
+      break;
+  }
+
+  mBanks = nearestBanks( mappingErrors( sources, palettes, lynxColors ) );
+  int iteration = 0;
+  for ( bool stable = false; !stable && iteration < BANK_ITERATIONS; ++iteration )
+  {
+    // banks no source is nearest to are dropped
+    std::vector<std::vector<size_t>> moved( palettes.size() );
+    for ( size_t i = 0; i < sources.size(); ++i )
+    {
+      moved[mBanks[i]].push_back( i );
+    }
+
+    members.clear();
+    std::vector<size_t> current( sources.size() );
+    for ( std::vector<size_t>& bank : moved )
+    {
+      if ( bank.empty() )
+        continue;
+
+      for ( size_t i : bank )
+      {
+        current[i] = members.size();
+      }
+      members.push_back( std::move( bank ) );
+    }
+
+    palettes.assign( members.size(), {} );
+    TaskGroup group;
+    for ( size_t bank = 0; bank < members.size(); ++bank )
+    {
+      group.run( [&, bank]
+      {
+        palettes[bank] = reduce( members[bank] );
+      } );
+    }
+    group.wait();
+
+    mBanks = nearestBanks( mappingErrors( sources, palettes, lynxColors ) );
+    stable = mBanks == current;
+  }
+
+  LOG << "Palette banks regrouped " << iteration << " times";
+
+  for ( size_t bank = 0; bank < members.size(); ++bank )
+  {
+    std::vector<std::filesystem::path> bankPaths;
+    for ( size_t i : members[bank] )
+    {
+      bankPaths.push_back( paths[i] );
+    }
+
+    std::optional<std::filesystem::path> const bankPalette = optimalPalette ? std::optional{ bankPath( *optimalPalette, bank, members.size() ) } : std::nullopt;
+    LOG << "Palette bank " << bank << " groups " << members[bank].size() << " images";
+    mPalettes.push_back( Palette{ histograms.merged( members[bank] ), bankPaths, maxColors, quantizer, refineIterations, lynxBins, lynxColors, bankPalette } );
+  }
+
+  if ( optimalPalette )
+  {
+    std::filesystem::path list = *optimalPalette;
+    list.replace_extension( ".banks" );
+    std::ofstream fout{ list };
+    for ( size_t i = 0; i < paths.size(); ++i )
+    {
+      fout << mBanks[i] << " " << paths[i].string() << "\n";
+    }
+
+    LOG << "Palette banks of " << paths.size() << " images listed in " << list;
+  }
+}
+
+void PaletteBanks::useNearestTable( std::filesystem::path const& cacheDir )
+{
+  for ( Palette& palette : mPalettes )
+  {
+    palette.useNearestTable( cacheDir );
+  }
+}
+
+size_t PaletteBanks::size() const
+{
+  return mPalettes.size();
+}
+
+Palette const& PaletteBanks::palette( size_t bank ) const
+{
+  return mPalettes[bank];
+}
+
+size_t PaletteBanks::bankOf( size_t source ) const
+{
+  return mBanks[source];
+}
+
+size_t PaletteBanks::bankOf( Image const& image ) const
+{
+  std::vector<WeightedColor> const colors = mLynxBins ? binColors( imageBins( image ) ) : imageColors( image );
+  std::vector<std::vector<Color>> palettes;
+  for ( Palette const& palette : mPalettes )
+  {
+    palettes.push_back( palette.colors() );
+  }
+
+  return nearestBanks( mappingErrors( { colors }, palettes, mLynxColors ) )[0];
+}
@@ -2,16 +2,31 @@
 
 #include <vector>
 #include <filesystem>
+#include <optional>
+#include <memory>
 #include "Color.hpp"
 
 class PNG;
-  
+class Image;
+class Quantizer;
+struct WeightedColor;
+class MappedFile;
+
 class Palette
 {
 public:
-  Palette( std::filesystem::path const& path, int maxColors, std::optional<std::filesystem::path> optimalPalette );
+  // Colors of all sources are counted together into one palette.
+  // lynxBins counts colors of the sources in bins of Lynx 12-bit colors instead of distinct colors,
+  // lynxColors reduces and maps colors as the Lynx colors they are displayed as, so no two colors of the palette look the same on the Lynx
+  Palette( std::vector<std::filesystem::path> const& paths, int maxColors, Quantizer const& quantizer, int refineIterations, bool lynxBins, bool lynxColors, std::optional<std::filesystem::path> optimalPalette );
+  // palette of an already decoded image, path is its source file
+  Palette( Image const& src, std::filesystem::path const& path, int maxColors, Quantizer const& quantizer, int refineIterations, bool lynxBins, bool lynxColors, std::optional<std::filesystem::path> optimalPalette );
   Palette( Palette const& ) = delete;
-  Palette( Palette && ) = default;
+  Palette( Palette && );
+  ~Palette();
+
+  // maps opaque colors through a table of nearest colors of 32x32x32 cells of RGB space cached in cacheDir under a hash of the palette
+  void useNearestTable( std::filesystem::path const& cacheDir );
 
   size_t size() const;
   size_t mapNearest( Color src ) const;
@@ -19,6 +34,42 @@ public:
   std::vector<Color> const& colors() const;
 
 private:
+  friend class PaletteBanks;
+
+  // reduces the counted colors of the source
+  Palette( std::vector<WeightedColor> colors, std::vector<std::filesystem::path> const& paths, int maxColors, Quantizer const& quantizer, int refineIterations, bool lynxBins, bool lynxColors, std::optional<std::filesystem::path> optimalPalette );
+
+  size_t searchNearest( Color src ) const;
+  std::vector<uint8_t> buildNearestTable() const;
+
   std::vector<Color> mColors;
+  bool mLynxColors;
+  std::unique_ptr<MappedFile> mTableFile;
+  std::vector<uint8_t> mTableData;
+  uint8_t const* mTable = nullptr;
 };
 
+// Palette sources partitioned into banks with a palette each, so that sprites of a scene with more colors than one palette holds need few palettes.
+// Sources are grouped to minimize the error of mapping their pixels to the palette of their bank, every source belongs to the bank mapping it best
+class PaletteBanks
+{
+public:
+  // makes at most banks palettes, optimalPalette saves every palette with the number of its bank appended and lists the bank of every source
+  PaletteBanks( std::vector<std::filesystem::path> const& paths, int banks, int maxColors, Quantizer const& quantizer, int refineIterations, bool lynxBins, bool lynxColors, std::optional<std::filesystem::path> optimalPalette );
+
+  void useNearestTable( std::filesystem::path const& cacheDir );
+
+  size_t size() const;
+  Palette const& palette( size_t bank ) const;
+
+  // bank of the source at the index of paths
+  size_t bankOf( size_t source ) const;
+  // bank whose palette maps colors of the image with the least error
+  size_t bankOf( Image const& image ) const;
+
+private:
+  std::vector<Palette> mPalettes;
+  std::vector<size_t> mBanks;
+  bool mLynxBins;
+  bool mLynxColors;
+};
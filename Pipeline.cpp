@@ -0,0 +1,69 @@
+#include "Pipeline.hpp"
+#include <fstream>
+#include <sstream>
+
+MemoryBudget::MemoryBudget( size_t limit ) : mLimit{ limit }, mUsed{}, mMutex{}, mReleased{}
+{
+}
+
+void MemoryBudget::acquire( size_t bytes )
+{
+  std::unique_lock<std::mutex> lock{ mMutex };
+  mReleased.wait( lock, [&]
+  {
+    return mUsed == 0 || mUsed + bytes <= mLimit;
+  } );
+  mUsed += bytes;
+}
+
+void MemoryBudget::release( size_t bytes )
+{
+  std::lock_guard<std::mutex> lock{ mMutex };
+  mUsed -= bytes;
+  mReleased.notify_all();
+}
+
+FileWriter::FileWriter( size_t capacity ) : mQueue{ capacity }, mErrors{}, mThread{}
+{
+  mThread = std::thread{ &FileWriter::work, this };
+}
+
+FileWriter::~FileWriter()
+{
+  finish();
+}
+
+void FileWriter::write( size_t tag, OutputFile file )
+{
+  mQueue.push( std::make_pair( tag, std::move( file ) ) );
+}
+
+std::vector<std::pair<size_t, std::string>> FileWriter::finish()
+{
+  if ( mThread.joinable() )
+  {
+    mQueue.close();
+    mThread.join();
+  }
+
+  return mErrors;
+}
+
+void FileWriter::work()
+{
+  while ( auto item = mQueue.pop() )
+  {
+    OutputFile const& file = item->second;
+
+    std::ofstream fout{ file.path, file.text ? std::ios::out : std::ios::binary };
+    fout.write( ( char const* )file.data.data(), file.data.size() );
+    fout.close();
+
+    if ( !fout )
+    {
+      std::stringstream ss;
+      ss << "Can't write " << file.path << "\n";
+      mErrors.emplace_back( item->first, ss.str() );
+    }
+  }
+}
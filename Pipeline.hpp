@@ -0,0 +1,105 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "Sprite.hpp"
+
+// Queue between two pipeline stages, push blocks while the queue is full
+template<typename T>
+class BoundedQueue
+{
+public:
+  explicit BoundedQueue( size_t capacity ) : mCapacity{ capacity }, mItems{}, mMutex{}, mChanged{}, mClosed{}
+  {
+  }
+
+  void push( T item )
+  {
+    std::unique_lock<std::mutex> lock{ mMutex };
+    mChanged.wait( lock, [this]
+    {
+      return mItems.size() < mCapacity;
+    } );
+    mItems.push_back( std::move( item ) );
+    mChanged.notify_all();
+  }
+
+  // blocks while the queue is empty, returns nothing once it is closed and empty
+  std::optional<T> pop()
+  {
+    std::unique_lock<std::mutex> lock{ mMutex };
+    mChanged.wait( lock, [this]
+    {
+      return !mItems.empty() || mClosed;
+    } );
+
+    if ( mItems.empty() )
+      return std::nullopt;
+
+    T item = std::move( mItems.front() );
+    mItems.pop_front();
+    mChanged.notify_all();
+    return item;
+  }
+
+  // no more items will be pushed
+  void close()
+  {
+    std::lock_guard<std::mutex> lock{ mMutex };
+    mClosed = true;
+    mChanged.notify_all();
+  }
+
+private:
+  size_t const mCapacity;
+  std::deque<T> mItems;
+  std::mutex mMutex;
+  std::condition_variable mChanged;
+  bool mClosed;
+};
+
+// Bytes held by pipeline stages. Acquiring blocks while the limit would be exceeded, unless nothing is held, so any single item passes
+class MemoryBudget
+{
+public:
+  explicit MemoryBudget( size_t limit );
+
+  void acquire( size_t bytes );
+  void release( size_t bytes );
+
+private:
+  size_t const mLimit;
+  size_t mUsed;
+  std::mutex mMutex;
+  std::condition_variable mReleased;
+};
+
+// Writes files on its own thread in the order they were queued, so writing overlaps packing of the next sprites
+class FileWriter
+{
+public:
+  // capacity is the number of files waiting to be written before write blocks
+  explicit FileWriter( size_t capacity );
+  ~FileWriter();
+  FileWriter( FileWriter const& ) = delete;
+  FileWriter& operator=( FileWriter const& ) = delete;
+
+  // tag identifies the job the file belongs to in errors
+  void write( size_t tag, OutputFile file );
+
+  // waits until all queued files are written and returns the tags and messages of files that failed
+  std::vector<std::pair<size_t, std::string>> finish();
+
+private:
+  void work();
+
+  BoundedQueue<std::pair<size_t, OutputFile>> mQueue;
+  std::vector<std::pair<size_t, std::string>> mErrors;
+  std::thread mThread;
+};
@@ -0,0 +1,998 @@
+#include "PngRowDecoder.hpp"
+#include "Ex.hpp"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+
+#include "lodepng.h"
+
+// SSP_NO_SSE2 builds only the portable unfilter and SSP_NO_AVX2 leaves out AVX2, so tests run every path on one machine
+#if ( defined( __SSE2__ ) || defined( _M_X64 ) ) && !defined( SSP_NO_SSE2 )
+#define SSP_SSE2
+#endif
+
+#if defined( SSP_SSE2 )
+#include <immintrin.h>
+#if defined( _MSC_VER )
+#include <intrin.h>
+#endif
+#endif
+
+namespace
+{
+
+// Reads bits least significant first from the contents of consecutive chunks
+class BitReader
+{
+public:
+  BitReader( std::vector<std::span<uint8_t const>> const& chunks ) : mChunks{ chunks }, mChunk{}, mPos{}, mBits{}, mCount{}, mPadded{}
+  {
+  }
+
+  uint32_t peek( int n )
+  {
+    if ( mCount < n )
+      refill();
+    return ( uint32_t )( mBits & ( ( uint64_t{ 1 } << n ) - 1 ) );
+  }
+
+  void consume( int n )
+  {
+    mBits >>= n;
+    mCount -= n;
+  }
+
+  uint32_t bits( int n )
+  {
+    uint32_t result = peek( n );
+    consume( n );
+    return result;
+  }
+
+  // skips to the next byte boundary
+  void align()
+  {
+    consume( mCount % 8 );
+  }
+
+  // copies n bytes from a byte boundary
+  void copy( uint8_t* dst, size_t n )
+  {
+    assert( mCount % 8 == 0 );
+    for ( ; n > 0 && mCount > 0; --n )
+    {
+      *dst++ = ( uint8_t )mBits;
+      consume( 8 );
+    }
+
+    if ( n == 0 )
+      return;
+
+    // bits above the count may hold a part of the next byte, which is copied now
+    mBits = 0;
+    while ( n > 0 )
+    {
+      while ( mChunk < mChunks.size() && mPos == mChunks[mChunk].size() )
+      {
+        mChunk += 1;
+        mPos = 0;
+      }
+
+      if ( mChunk == mChunks.size() )
+        throw Ex{} << "PNG image data is truncated";
+
+      size_t const size = std::min( n, mChunks[mChunk].size() - mPos );
+      std::memcpy( dst, mChunks[mChunk].data() + mPos, size );
+      dst += size;
+      mPos += size;
+      n -= size;
+    }
+  }
+
+private:
+  void refill()
+  {
+    // Whole words are loaded while the chunk has 8 more bytes. Only bytes loaded completely are counted,
+    // the part of a byte loaded above them is loaded again with the same value by the next refill
+    if ( mChunk < mChunks.size() && mChunks[mChunk].size() - mPos >= 8 )
+    {
+      uint8_t const* next = mChunks[mChunk].data() + mPos;
+      uint64_t word = 0;
+      if constexpr ( std::endian::native == std::endian::little )
+      {
+        std::memcpy( &word, next, sizeof( word ) );
+      }
+      else
+      {
+        for ( int i = 0; i < 8; ++i )
+        {
+          word |= ( uint64_t )next[i] << ( i * 8 );
+        }
+      }
+      mBits |= word << mCount;
+      int const bytes = ( 63 - mCount ) / 8;
+      mPos += bytes;
+      mCount += bytes * 8;
+      return;
+    }
+
+    while ( mCount <= 56 )
+    {
+      while ( mChunk < mChunks.size() && mPos == mChunks[mChunk].size() )
+      {
+        mChunk += 1;
+        mPos = 0;
+      }
+
+      uint8_t byte = 0;
+      if ( mChunk < mChunks.size() )
+      {
+        byte = mChunks[mChunk][mPos++];
+      }
+      // zero bytes past the end fill the look ahead, consuming any of them means the data is cut short
+      else if ( ++mPadded > 8 )
+      {
+        throw Ex{} << "PNG image data is truncated";
+      }
+
+      mBits |= ( uint64_t )byte << mCount;
+      mCount += 8;
+    }
+  }
+
+  std::vector<std::span<uint8_t const>> const& mChunks;
+  size_t mChunk;
+  size_t mPos;
+  uint64_t mBits;
+  int mCount;
+  int mPadded;
+};
+
+// Canonical Huffman code. Codes up to FAST_BITS long are decoded by a table lookup, longer ones bit by bit.
+// Codes of literals also have a table of PAIR_BITS giving two literals at once when both of their codes fit in it
+class Huffman
+{
+public:
+  static constexpr int FAST_BITS = 10;
+  static constexpr int PAIR_BITS = 11;
+  static_assert( PAIR_BITS <= FAST_BITS + 1, "the second code of a pair is looked up in the fast table" );
+
+  Huffman( uint8_t const* lengths, int count, bool literals = false ) : mCounts{}, mSymbols{}, mFast{}, mPairs{}
+  {
+    for ( int i = 0; i < count; ++i )
+    {
+      mCounts[lengths[i]] += 1;
+    }
+    mCounts[0] = 0;
+
+    int left = 1;
+    for ( int len = 1; len < 16; ++len )
+    {
+      left = ( left << 1 ) - mCounts[len];
+      if ( left < 0 )
+        throw Ex{} << "Invalid Huffman code in PNG image data";
+    }
+
+    std::array<uint16_t, 16> offsets{};
+    for ( int len = 1; len < 15; ++len )
+    {
+      offsets[len + 1] = offsets[len] + mCounts[len];
+    }
+    for ( int i = 0; i < count; ++i )
+    {
+      if ( lengths[i] )
+        mSymbols[offsets[lengths[i]]++] = ( uint16_t )i;
+    }
+
+    // codes are stored most significant bit first, so the table is indexed by reversed codes
+    uint32_t code = 0;
+    int index = 0;
+    for ( int len = 1; len <= FAST_BITS; ++len, code <<= 1 )
+    {
+      for ( int k = 0; k < mCounts[len]; ++k, ++code, ++index )
+      {
+        uint32_t reversed = 0;
+        for ( int b = 0; b < len; ++b )
+        {
+          reversed |= ( ( code >> b ) & 1 ) << ( len - 1 - b );
+        }
+        for ( uint32_t i = reversed; i < mFast.size(); i += 1u << len )
+        {
+          mFast[i] = ( uint16_t )( mSymbols[index] << 4 | len );
+        }
+      }
+    }
+
+    if ( !literals )
+      return;
+
+    // the second code is looked up by the bits following the first one, which are enough only if it is short enough
+    for ( uint32_t i = 0; i < mPairs.size(); ++i )
+    {
+      uint16_t const first = mFast[i & ( mFast.size() - 1 )];
+      if ( !first || ( first >> 4 ) >= 256 )
+        continue;
+
+      int const firstLength = first & 15;
+      uint16_t const second = mFast[i >> firstLength];
+      if ( second && ( second >> 4 ) < 256 && firstLength + ( second & 15 ) <= PAIR_BITS )
+      {
+        mPairs[i] = ( uint32_t )( second >> 4 ) << 16 | ( uint32_t )( first >> 4 ) << 8 | 2 << 4 | ( firstLength + ( second & 15 ) );
+      }
+      else
+      {
+        mPairs[i] = ( uint32_t )( first >> 4 ) << 8 | 1 << 4 | firstLength;
+      }
+    }
+  }
+
+  // Entry of the literals starting the bits, 0 if they don't start with a literal of a short code.
+  // Bits 0-3 are the length of codes, bits 4-5 the number of literals and the literals are in bytes 1 and 2
+  uint32_t pair( BitReader& in ) const
+  {
+    return mPairs[in.peek( PAIR_BITS )];
+  }
+
+  int decode( BitReader& in ) const
+  {
+    uint32_t const bits = in.peek( 15 );
+    if ( uint16_t entry = mFast[bits & ( mFast.size() - 1 )] )
+    {
+      in.consume( entry & 15 );
+      return entry >> 4;
+    }
+
+    int code = 0;
+    int first = 0;
+    int index = 0;
+    for ( int len = 1; len < 16; ++len )
+    {
+      code |= ( bits >> ( len - 1 ) ) & 1;
+      int const count = mCounts[len];
+      if ( code - count < first )
+      {
+        in.consume( len );
+        return mSymbols[index + code - first];
+      }
+      index += count;
+      first = ( first + count ) << 1;
+      code <<= 1;
+    }
+
+    throw Ex{} << "Invalid Huffman code in PNG image data";
+  }
+
+private:
+  std::array<uint16_t, 16> mCounts;
+  std::array<uint16_t, 320> mSymbols;
+  std::array<uint16_t, 1 << FAST_BITS> mFast;
+  std::array<uint32_t, 1 << PAIR_BITS> mPairs;
+};
+
+uint16_t const LENGTH_BASE[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+uint8_t const LENGTH_EXTRA[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+uint16_t const DISTANCE_BASE[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+uint8_t const DISTANCE_EXTRA[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+Huffman const& fixedLiterals()
+{
+  static Huffman const code = []
+  {
+    uint8_t lengths[288];
+    std::fill( lengths, lengths + 144, 8 );
+    std::fill( lengths + 144, lengths + 256, 9 );
+    std::fill( lengths + 256, lengths + 280, 7 );
+    std::fill( lengths + 280, lengths + 288, 8 );
+    return Huffman{ lengths, 288, true };
+  }();
+  return code;
+}
+
+Huffman const& fixedDistances()
+{
+  static Huffman const code = []
+  {
+    uint8_t lengths[32];
+    std::fill( lengths, lengths + 32, 5 );
+    return Huffman{ lengths, 32 };
+  }();
+  return code;
+}
+
+// Inflates a zlib stream. The output is passed to sink in pieces, only the last 32 KiB are kept for back references
+void inflate( std::vector<std::span<uint8_t const>> const& chunks, std::function<void( uint8_t const*, size_t )> const& sink )
+{
+  static constexpr size_t WINDOW = 32768;
+  static constexpr size_t PIECE = 65536;
+  static constexpr size_t MAX_MATCH = 258;
+  // matches are copied by 8 bytes and may write up to 7 bytes past their end
+  static constexpr size_t SLACK = MAX_MATCH + 8;
+
+  BitReader in{ chunks };
+
+  uint32_t const cmf = in.bits( 8 );
+  uint32_t const flg = in.bits( 8 );
+  if ( ( cmf & 15 ) != 8 || ( cmf >> 4 ) > 7 || ( cmf * 256 + flg ) % 31 != 0 || ( flg & 32 ) )
+    throw Ex{} << "Invalid zlib header in PNG image data";
+
+  std::vector<uint8_t> out( WINDOW + PIECE + SLACK );
+  size_t pos = 0;
+  size_t flushed = 0;
+  uint32_t adlerA = 1;
+  uint32_t adlerB = 0;
+
+  auto flush = [&]
+  {
+    for ( size_t i = flushed; i < pos; )
+    {
+      // largest run whose sums can't overflow before the modulo
+      size_t const end = std::min( pos, i + 5552 );
+      for ( ; i < end; ++i )
+      {
+        adlerA += out[i];
+        adlerB += adlerA;
+      }
+      adlerA %= 65521;
+      adlerB %= 65521;
+    }
+    sink( out.data() + flushed, pos - flushed );
+    flushed = pos;
+  };
+
+  auto makeRoom = [&]
+  {
+    if ( pos >= WINDOW + PIECE )
+    {
+      flush();
+      std::memmove( out.data(), out.data() + pos - WINDOW, WINDOW );
+      pos = flushed = WINDOW;
+    }
+  };
+
+  for ( bool last = false; !last; )
+  {
+    last = in.bits( 1 ) != 0;
+    uint32_t const type = in.bits( 2 );
+
+    if ( type == 0 )
+    {
+      in.align();
+      uint32_t len = in.bits( 16 );
+      if ( len != ( ~in.bits( 16 ) & 0xffff ) )
+        throw Ex{} << "Invalid stored block in PNG image data";
+
+      while ( len > 0 )
+      {
+        makeRoom();
+        size_t const size = std::min<size_t>( len, WINDOW + PIECE - pos );
+        in.copy( out.data() + pos, size );
+        pos += size;
+        len -= ( uint32_t )size;
+      }
+      continue;
+    }
+
+    if ( type == 3 )
+      throw Ex{} << "Invalid block type in PNG image data";
+
+    std::optional<Huffman> dynamicLiterals;
+    std::optional<Huffman> dynamicDistances;
+
+    if ( type == 2 )
+    {
+      static constexpr uint8_t ORDER[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+      int const literals = ( int )in.bits( 5 ) + 257;
+      int const distances = ( int )in.bits( 5 ) + 1;
+      int const codeLengths = ( int )in.bits( 4 ) + 4;
+
+      uint8_t lengths[320] = {};
+      for ( int i = 0; i < codeLengths; ++i )
+      {
+        lengths[ORDER[i]] = ( uint8_t )in.bits( 3 );
+      }
+      Huffman const lengthCode{ lengths, 19 };
+
+      std::fill( lengths, lengths + 19, 0 );
+      for ( int i = 0; i < literals + distances; )
+      {
+        int const symbol = lengthCode.decode( in );
+        if ( symbol < 16 )
+        {
+          lengths[i++] = ( uint8_t )symbol;
+          continue;
+        }
+
+        uint8_t value = 0;
+        int repeat;
+        if ( symbol == 16 )
+        {
+          if ( i == 0 )
+            throw Ex{} << "Invalid code lengths in PNG image data";
+          value = lengths[i - 1];
+          repeat = 3 + ( int )in.bits( 2 );
+        }
+        else if ( symbol == 17 )
+        {
+          repeat = 3 + ( int )in.bits( 3 );
+        }
+        else
+        {
+          repeat = 11 + ( int )in.bits( 7 );
+        }
+
+        if ( i + repeat > literals + distances )
+          throw Ex{} << "Invalid code lengths in PNG image data";
+
+        std::fill( lengths + i, lengths + i + repeat, value );
+        i += repeat;
+      }
+
+      if ( lengths[256] == 0 )
+        throw Ex{} << "Missing end of block code in PNG image data";
+
+      dynamicLiterals.emplace( lengths, literals, true );
+      dynamicDistances.emplace( lengths + literals, distances );
+    }
+
+    Huffman const& literalCode = dynamicLiterals ? *dynamicLiterals : fixedLiterals();
+    Huffman const& distanceCode = dynamicDistances ? *dynamicDistances : fixedDistances();
+
+    for ( ;; )
+    {
+      makeRoom();
+
+      if ( uint32_t const pair = literalCode.pair( in ) )
+      {
+        in.consume( pair & 15 );
+        out[pos] = ( uint8_t )( pair >> 8 );
+        out[pos + 1] = ( uint8_t )( pair >> 16 );
+        pos += ( pair >> 4 ) & 3;
+        continue;
+      }
+
+      int symbol = literalCode.decode( in );
+      if ( symbol < 256 )
+      {
+        out[pos++] = ( uint8_t )symbol;
+        continue;
+      }
+      if ( symbol == 256 )
+        break;
+
+      symbol -= 257;
+      if ( symbol >= 29 )
+        throw Ex{} << "Invalid length code in PNG image data";
+      size_t const length = LENGTH_BASE[symbol] + in.bits( LENGTH_EXTRA[symbol] );
+
+      int const code = distanceCode.decode( in );
+      if ( code >= 30 )
+        throw Ex{} << "Invalid distance code in PNG image data";
+      size_t const distance = DISTANCE_BASE[code] + in.bits( DISTANCE_EXTRA[code] );
+      if ( distance > pos )
+        throw Ex{} << "Invalid distance in PNG image data";
+
+      // a match may overlap its own output, it is copied by words only when they don't overlap
+      uint8_t* dst = out.data() + pos;
+      uint8_t const* src = dst - distance;
+      if ( distance >= 8 )
+      {
+        for ( size_t i = 0; i < length; i += 8 )
+        {
+          std::memcpy( dst + i, src + i, 8 );
+        }
+      }
+      else if ( distance == 1 )
+      {
+        std::memset( dst, *src, length );
+      }
+      else
+      {
+        for ( size_t i = 0; i < length; ++i )
+        {
+          dst[i] = src[i];
+        }
+      }
+      pos += length;
+    }
+  }
+
+  flush();
+
+  in.align();
+  uint32_t adler = 0;
+  for ( int i = 0; i < 4; ++i )
+  {
+    adler = adler << 8 | in.bits( 8 );
+  }
+  if ( adler != ( adlerB << 16 | adlerA ) )
+    throw Ex{} << "Adler-32 checksum mismatch in PNG image data";
+}
+
+uint8_t paeth( uint8_t a, uint8_t b, uint8_t c )
+{
+  int const pa = std::abs( b - c );
+  int const pb = std::abs( a - c );
+  int const pc = std::abs( a + b - c - c );
+  if ( pa <= pb && pa <= pc )
+    return a;
+  return pb <= pc ? b : c;
+}
+
+void unfilterScalar( int type, uint8_t* row, uint8_t const* prev, size_t size, size_t bpp )
+{
+  switch ( type )
+  {
+  case 1:
+    for ( size_t i = bpp; i < size; ++i )
+    {
+      row[i] += row[i - bpp];
+    }
+    break;
+  case 2:
+    for ( size_t i = 0; i < size; ++i )
+    {
+      row[i] += prev[i];
+    }
+    break;
+  case 3:
+    for ( size_t i = 0; i < bpp; ++i )
+    {
+      row[i] += prev[i] >> 1;
+    }
+    for ( size_t i = bpp; i < size; ++i )
+    {
+      row[i] += ( uint8_t )( ( row[i - bpp] + prev[i] ) >> 1 );
+    }
+    break;
+  case 4:
+    for ( size_t i = 0; i < bpp; ++i )
+    {
+      row[i] += prev[i];
+    }
+    for ( size_t i = bpp; i < size; ++i )
+    {
+      row[i] += paeth( row[i - bpp], prev[i], prev[i - bpp] );
+    }
+    break;
+  }
+}
+
+#if defined( SSP_SSE2 )
+
+// Sub, Average and Paeth filters depend on the pixel to the left, so they are reversed a pixel at a time in the low lanes of a register.
+// Up has no such dependency and is reversed a register at a time, with 32 byte registers when the processor has them
+
+bool hasAvx2()
+{
+#if defined( SSP_NO_AVX2 )
+  return false;
+#elif defined( _MSC_VER )
+  int info[4];
+  __cpuid( info, 0 );
+  if ( info[0] < 7 )
+    return false;
+
+  __cpuid( info, 1 );
+  bool const saved = ( info[2] & ( 1 << 27 ) ) && ( _xgetbv( 0 ) & 6 ) == 6;
+  __cpuidex( info, 7, 0 );
+  return saved && ( info[1] & ( 1 << 5 ) );
+#else
+  return __builtin_cpu_supports( "avx2" );
+#endif
+}
+
+#if defined( __GNUC__ )
+__attribute__(( target( "avx2" ) ))
+#endif
+void unfilterUpAvx2( uint8_t* row, uint8_t const* prev, size_t size )
+{
+  size_t i = 0;
+  for ( ; i + 32 <= size; i += 32 )
+  {
+    __m256i const x = _mm256_loadu_si256( ( __m256i const* )( row + i ) );
+    __m256i const b = _mm256_loadu_si256( ( __m256i const* )( prev + i ) );
+    _mm256_storeu_si256( ( __m256i* )( row + i ), _mm256_add_epi8( x, b ) );
+  }
+  for ( ; i < size; ++i )
+  {
+    row[i] += prev[i];
+  }
+}
+
+void unfilterUpSse2( uint8_t* row, uint8_t const* prev, size_t size )
+{
+  size_t i = 0;
+  for ( ; i + 16 <= size; i += 16 )
+  {
+    __m128i const x = _mm_loadu_si128( ( __m128i const* )( row + i ) );
+    __m128i const b = _mm_loadu_si128( ( __m128i const* )( prev + i ) );
+    _mm_storeu_si128( ( __m128i* )( row + i ), _mm_add_epi8( x, b ) );
+  }
+  for ( ; i < size; ++i )
+  {
+    row[i] += prev[i];
+  }
+}
+
+template<int bpp>
+__m128i loadPixel( uint8_t const* p )
+{
+  int32_t value = 0;
+  std::memcpy( &value, p, bpp );
+  return _mm_cvtsi32_si128( value );
+}
+
+template<int bpp>
+void storePixel( uint8_t* p, __m128i pixel )
+{
+  int32_t const value = _mm_cvtsi128_si32( pixel );
+  std::memcpy( p, &value, bpp );
+}
+
+template<int bpp>
+void unfilterSse2( int type, uint8_t* row, uint8_t const* prev, size_t size )
+{
+  __m128i const zero = _mm_setzero_si128();
+
+  switch ( type )
+  {
+  case 1:
+  {
+    __m128i a = zero;
+    for ( size_t i = 0; i < size; i += bpp )
+    {
+      a = _mm_add_epi8( a, loadPixel<bpp>( row + i ) );
+      storePixel<bpp>( row + i, a );
+    }
+    break;
+  }
+  case 3:
+  {
+    // the rounded up average of a and b less the bit rounding it up is the rounded down average
+    __m128i const one = _mm_set1_epi8( 1 );
+    __m128i a = zero;
+    for ( size_t i = 0; i < size; i += bpp )
+    {
+      __m128i const b = loadPixel<bpp>( prev + i );
+      __m128i const average = _mm_sub_epi8( _mm_avg_epu8( a, b ), _mm_and_si128( _mm_xor_si128( a, b ), one ) );
+      a = _mm_add_epi8( average, loadPixel<bpp>( row + i ) );
+      storePixel<bpp>( row + i, a );
+    }
+    break;
+  }
+  case 4:
+  {
+    // 16-bit lanes hold the differences, the predictor with the smallest one wins and ties go to a, then b
+    __m128i a = zero;
+    __m128i c = zero;
+    for ( size_t i = 0; i < size; i += bpp )
+    {
+      __m128i const b = _mm_unpacklo_epi8( loadPixel<bpp>( prev + i ), zero );
+      __m128i pa = _mm_sub_epi16( b, c );
+      __m128i pb = _mm_sub_epi16( a, c );
+      __m128i pc = _mm_add_epi16( pa, pb );
+      pa = _mm_max_epi16( pa, _mm_sub_epi16( zero, pa ) );
+      pb = _mm_max_epi16( pb, _mm_sub_epi16( zero, pb ) );
+      pc = _mm_max_epi16( pc, _mm_sub_epi16( zero, pc ) );
+
+      __m128i const smallest = _mm_min_epi16( pc, _mm_min_epi16( pa, pb ) );
+      __m128i const isA = _mm_cmpeq_epi16( smallest, pa );
+      __m128i const isB = _mm_andnot_si128( isA, _mm_cmpeq_epi16( smallest, pb ) );
+      __m128i const isC = _mm_andnot_si128( _mm_or_si128( isA, isB ), _mm_set1_epi16( -1 ) );
+      __m128i const predicted = _mm_or_si128( _mm_or_si128( _mm_and_si128( isA, a ), _mm_and_si128( isB, b ) ), _mm_and_si128( isC, c ) );
+
+      __m128i const x = _mm_add_epi8( _mm_packus_epi16( predicted, predicted ), loadPixel<bpp>( row + i ) );
+      storePixel<bpp>( row + i, x );
+      a = _mm_unpacklo_epi8( x, zero );
+      c = b;
+    }
+    break;
+  }
+  }
+}
+
+#endif
+
+// reverses the filter of a row in place, prev is the unfiltered previous row or zeros, bpp is the number of bytes per pixel rounded up
+void unfilter( int type, uint8_t* row, uint8_t const* prev, size_t size, size_t bpp )
+{
+  if ( type == 0 )
+    return;
+
+  if ( type > 4 )
+    throw Ex{} << "Invalid filter type " << type << " in PNG image data";
+
+#if defined( SSP_SSE2 )
+  if ( type == 2 )
+  {
+    static bool const avx2 = hasAvx2();
+    if ( avx2 )
+      unfilterUpAvx2( row, prev, size );
+    else
+      unfilterUpSse2( row, prev, size );
+    return;
+  }
+
+  // 8-bit RGB and RGBA, other formats have too few bytes per pixel to gain from it
+  if ( bpp == 3 )
+  {
+    unfilterSse2<3>( type, row, prev, size );
+    return;
+  }
+  if ( bpp == 4 )
+  {
+    unfilterSse2<4>( type, row, prev, size );
+    return;
+  }
+#endif
+
+  unfilterScalar( type, row, prev, size, bpp );
+}
+
+// CRC-32 of PNG chunks, computed 8 bytes at a time with tables of the CRC of every byte followed by 0 to 7 zero bytes
+uint32_t crc32( uint8_t const* data, size_t size )
+{
+  static auto const tables = []
+  {
+    std::array<std::array<uint32_t, 256>, 8> result{};
+    for ( uint32_t i = 0; i < 256; ++i )
+    {
+      uint32_t crc = i;
+      for ( int k = 0; k < 8; ++k )
+      {
+        crc = crc & 1 ? 0xedb88320u ^ ( crc >> 1 ) : crc >> 1;
+      }
+      result[0][i] = crc;
+    }
+    for ( int t = 1; t < 8; ++t )
+    {
+      for ( uint32_t i = 0; i < 256; ++i )
+      {
+        result[t][i] = ( result[t - 1][i] >> 8 ) ^ result[0][result[t - 1][i] & 0xff];
+      }
+    }
+    return result;
+  }();
+
+  uint32_t crc = 0xffffffffu;
+  for ( ; size >= 8; size -= 8, data += 8 )
+  {
+    uint32_t const low = crc ^ ( data[0] | data[1] << 8 | data[2] << 16 | ( uint32_t )data[3] << 24 );
+    crc = tables[7][low & 0xff] ^ tables[6][( low >> 8 ) & 0xff] ^ tables[5][( low >> 16 ) & 0xff] ^ tables[4][low >> 24] ^
+      tables[3][data[4]] ^ tables[2][data[5]] ^ tables[1][data[6]] ^ tables[0][data[7]];
+  }
+  for ( ; size > 0; --size, ++data )
+  {
+    crc = tables[0][( crc ^ *data ) & 0xff] ^ ( crc >> 8 );
+  }
+  return crc ^ 0xffffffffu;
+}
+
+// reads the header and the chunks describing colors into the state
+void readColors( LodePNGState& state, uint8_t const* data, size_t size, std::vector<size_t> const& colorChunks )
+{
+  unsigned width;
+  unsigned height;
+  lodepng_inspect( &width, &height, &state, data, size );
+  for ( size_t pos : colorChunks )
+  {
+    if ( unsigned error = lodepng_inspect_chunk( &state, pos, data, size ) )
+    {
+      throw Ex{} << "PNG decoder error " << error << ": " << lodepng_error_text( error );
+    }
+  }
+}
+
+// LodePNGState released when leaving the scope
+struct State
+{
+  LodePNGState state;
+
+  State()
+  {
+    lodepng_state_init( &state );
+  }
+
+  ~State()
+  {
+    lodepng_state_cleanup( &state );
+  }
+};
+
+}
+
+PngRowDecoder::PngRowDecoder( uint8_t const* data, size_t size ) : mData{ data }, mSize{ size }, mWidth{}, mHeight{}, mInterlaced{}, mIndexed{}, mBitDepth{}, mStride{}, mBytesPerPixel{},
+  mColorChunks{}, mIdat{}
+{
+  State s;
+  if ( unsigned error = lodepng_inspect( &mWidth, &mHeight, &s.state, data, size ) )
+  {
+    throw Ex{} << "PNG decoder error " << error << ": " << lodepng_error_text( error );
+  }
+  mInterlaced = s.state.info_png.interlace_method != 0;
+  mIndexed = s.state.info_png.color.colortype == LCT_PALETTE;
+  mBitDepth = s.state.info_png.color.bitdepth;
+
+  size_t const bitsPerPixel = lodepng_get_bpp( &s.state.info_png.color );
+  mStride = ( mWidth * bitsPerPixel + 7 ) / 8;
+  mBytesPerPixel = ( bitsPerPixel + 7 ) / 8;
+
+  uint8_t const* const end = data + size;
+  for ( uint8_t const* chunk = data + 8;; chunk = lodepng_chunk_next_const( chunk ) )
+  {
+    if ( end - chunk < 12 || lodepng_chunk_length( chunk ) > ( size_t )( end - chunk ) - 12 )
+      throw Ex{} << "PNG file is truncated";
+
+    size_t const length = lodepng_chunk_length( chunk );
+    uint8_t const* stored = chunk + 8 + length;
+    if ( crc32( chunk + 4, length + 4 ) != ( ( uint32_t )stored[0] << 24 | stored[1] << 16 | stored[2] << 8 | stored[3] ) )
+      throw Ex{} << "PNG chunk CRC mismatch";
+
+    if ( lodepng_chunk_type_equals( chunk, "IDAT" ) )
+    {
+      mIdat.emplace_back( lodepng_chunk_data_const( chunk ), length );
+    }
+    else if ( lodepng_chunk_type_equals( chunk, "PLTE" ) || lodepng_chunk_type_equals( chunk, "tRNS" ) )
+    {
+      mColorChunks.push_back( ( size_t )( chunk - data ) );
+    }
+    else if ( lodepng_chunk_type_equals( chunk, "IEND" ) )
+    {
+      break;
+    }
+    else if ( !lodepng_chunk_ancillary( chunk ) && !lodepng_chunk_type_equals( chunk, "IHDR" ) )
+    {
+      throw Ex{} << "Unknown critical PNG chunk";
+    }
+  }
+
+  if ( mIdat.empty() )
+    throw Ex{} << "PNG image has no image data";
+}
+
+int PngRowDecoder::width() const
+{
+  return ( int )mWidth;
+}
+
+int PngRowDecoder::height() const
+{
+  return ( int )mHeight;
+}
+
+bool PngRowDecoder::interlaced() const
+{
+  return mInterlaced;
+}
+
+bool PngRowDecoder::indexed() const
+{
+  return mIndexed;
+}
+
+void PngRowDecoder::decode( std::function<void( int y, std::span<Color const> row )> const& fun ) const
+{
+  State s;
+  readColors( s.state, mData, mSize, mColorChunks );
+
+  LodePNGColorMode const& mode = s.state.info_png.color;
+  LodePNGColorMode rgba;
+  lodepng_color_mode_init( &rgba );
+
+  // 8-bit RGBA rows are passed on as they are unfiltered
+  if ( mode.colortype == LCT_RGBA && mode.bitdepth == 8 )
+  {
+    unfilterRows( [&]( unsigned y, uint8_t const* row )
+    {
+      fun( ( int )y, std::span<Color const>{ ( Color const* )row, mWidth } );
+    } );
+    return;
+  }
+
+  std::vector<Color> pixels( mWidth );
+  unfilterRows( [&]( unsigned y, uint8_t const* row )
+  {
+    if ( unsigned error = lodepng_convert( ( uint8_t* )pixels.data(), row, &rgba, &mode, mWidth, 1 ) )
+    {
+      throw Ex{} << "PNG decoder error " << error << ": " << lodepng_error_text( error );
+    }
+    fun( ( int )y, pixels );
+  } );
+}
+
+std::vector<Color> PngRowDecoder::palette() const
+{
+  State s;
+  readColors( s.state, mData, mSize, mColorChunks );
+
+  LodePNGColorMode const& mode = s.state.info_png.color;
+  std::vector<Color> result( 256, Color{ 0, 0, 0, 255 } );
+  for ( size_t i = 0; i < std::min<size_t>( mode.palettesize, result.size() ); ++i )
+  {
+    uint8_t const* entry = mode.palette + i * 4;
+    result[i] = Color{ entry[0], entry[1], entry[2], entry[3] };
+  }
+
+  return result;
+}
+
+void PngRowDecoder::decodeIndices( std::function<void( int y, std::span<uint8_t const> row )> const& fun ) const
+{
+  assert( mIndexed );
+
+  if ( mBitDepth == 8 )
+  {
+    unfilterRows( [&]( unsigned y, uint8_t const* row )
+    {
+      fun( ( int )y, std::span<uint8_t const>{ row, mWidth } );
+    } );
+    return;
+  }
+
+  // indices narrower than a byte are packed from the most significant bits
+  std::vector<uint8_t> indices( mWidth );
+  unsigned const perByte = 8 / mBitDepth;
+  unsigned const mask = ( 1u << mBitDepth ) - 1;
+  unfilterRows( [&]( unsigned y, uint8_t const* row )
+  {
+    for ( unsigned x = 0; x < mWidth; ++x )
+    {
+      indices[x] = ( uint8_t )( row[x / perByte] >> ( 8 - mBitDepth * ( x % perByte + 1 ) ) & mask );
+    }
+    fun( ( int )y, indices );
+  } );
+}
+
+void PngRowDecoder::unfilterRows( std::function<void( unsigned y, uint8_t const* row )> const& fun ) const
+{
+  assert( !mInterlaced );
+
+  // rows are held in color sized units, so an unfiltered RGBA row is aligned as pixels
+  size_t const units = ( mStride + sizeof( Color ) - 1 ) / sizeof( Color );
+  std::vector<Color> rowBuffer( units );
+  std::vector<Color> prevBuffer( units );
+  uint8_t* row = ( uint8_t* )rowBuffer.data();
+  uint8_t* prev = ( uint8_t* )prevBuffer.data();
+  // the filter type byte precedes every row
+  int filter = -1;
+  size_t filled = 0;
+  unsigned y = 0;
+
+  inflate( mIdat, [&]( uint8_t const* data, size_t size )
+  {
+    while ( size > 0 && y < mHeight )
+    {
+      if ( filter < 0 )
+      {
+        filter = *data++;
+        size -= 1;
+        continue;
+      }
+
+      size_t const n = std::min( size, mStride - filled );
+      std::memcpy( row + filled, data, n );
+      filled += n;
+      data += n;
+      size -= n;
+
+      if ( filled == mStride )
+      {
+        unfilter( filter, row, prev, mStride, mBytesPerPixel );
+        fun( y, row );
+
+        std::swap( row, prev );
+        filter = -1;
+        filled = 0;
+        y += 1;
+      }
+    }
+  } );
+
+  if ( y < mHeight )
+    throw Ex{} << "PNG image data is truncated";
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <span>
+#include <vector>
+#include "Color.hpp"
+
+// Decodes a non interlaced PNG row by row. The image data is inflated through a 32 KiB window and every row is unfiltered
+// against the previous one, so memory use does not grow with the height of the image. Pixels are the same as lodepng_decode32 gives
+class PngRowDecoder
+{
+public:
+  // data of the whole PNG file, it must outlive the decoder
+  PngRowDecoder( uint8_t const* data, size_t size );
+
+  int width() const;
+  int height() const;
+  bool interlaced() const;
+  // whether pixels are indices to the palette
+  bool indexed() const;
+
+  // decodes the image from its first row, calling fun with the RGBA pixels of every row in order
+  void decode( std::function<void( int y, std::span<Color const> row )> const& fun ) const;
+
+  // 256 RGBA colors of palette indices as decode gives them, indices past the palette are opaque black
+  std::vector<Color> palette() const;
+
+  // decodes an indexed image from its first row, calling fun with the palette indices of every row in order
+  void decodeIndices( std::function<void( int y, std::span<uint8_t const> row )> const& fun ) const;
+
+private:
+  // inflates and unfilters rows, calling fun with the bytes of every row
+  void unfilterRows( std::function<void( unsigned y, uint8_t const* row )> const& fun ) const;
+
+  uint8_t const* mData;
+  size_t mSize;
+  unsigned mWidth;
+  unsigned mHeight;
+  bool mInterlaced;
+  bool mIndexed;
+  unsigned mBitDepth;
+  size_t mStride;
+  size_t mBytesPerPixel;
+  // offsets of chunks describing colors, PLTE and tRNS
+  std::vector<size_t> mColorChunks;
+  // contents of IDAT chunks, which form one zlib stream
+  std::vector<std::span<uint8_t const>> mIdat;
+};
@@ -1,26 +1,83 @@
 #include "ProgramOptions.hpp"
+#include <algorithm>
 #include <iostream>
+#include <string_view>
+#include <thread>
 #include "Ex.hpp"
 
 namespace po = boost::program_options;
 
-ProgramOptions::ProgramOptions( int argc, char const* argv[] )
+namespace
+{
+
+// whether name matches pattern, where * matches any characters and ? any single character
+bool matches( std::string_view pattern, std::string_view name )
+{
+  if ( pattern.empty() )
+    return name.empty();
+
+  if ( pattern[0] == '*' )
+    return matches( pattern.substr( 1 ), name ) || ( !name.empty() && matches( pattern, name.substr( 1 ) ) );
+
+  return !name.empty() && ( pattern[0] == '?' || pattern[0] == name[0] ) && matches( pattern.substr( 1 ), name.substr( 1 ) );
+}
+
+// files matching wildcards in the file name of pattern sorted by name, or the file itself if it exists
+std::vector<std::filesystem::path> expand( std::filesystem::path const& pattern )
+{
+  std::string const name = pattern.filename().string();
+  if ( name.find_first_of( "*?" ) == std::string::npos )
+    return std::filesystem::exists( pattern ) ? std::vector<std::filesystem::path>{ pattern } : std::vector<std::filesystem::path>{};
+
+  std::vector<std::filesystem::path> result;
+  std::filesystem::path const dir = pattern.parent_path();
+  std::error_code ec;
+  for ( auto const& entry : std::filesystem::directory_iterator{ dir.empty() ? std::filesystem::path{ "." } : dir, ec } )
+  {
+    if ( entry.is_regular_file() && matches( name, entry.path().filename().string() ) )
+      result.push_back( dir / entry.path().filename() );
+  }
+
+  std::sort( result.begin(), result.end() );
+  return result;
+}
+
+}
+
+ProgramOptions::ProgramOptions( int argc, char const* argv[] ) : ProgramOptions{ std::vector<std::string>{ argv + 1, argv + argc } }
+{
+}
+
+ProgramOptions::ProgramOptions( std::vector<std::string> const& args )
 {
   mDesc.add_options()
     ( "help,h", "produce help message" )
     ( "input,i", po::value<std::string>(), "input file, fist implicit agrument" )
+    ( "manifest,m", po::value<std::string>(), "file with arguments of one sprite per line, packs all of them reusing palettes (default: pack input)" )
     ( "output,o", po::value<std::string>(), "output file, second implicit argument (default: input with .spr extension)" )
-    ( "palette,p", po::value<std::string>(), "image to compute palette from (default: input)" )
+    ( "palette,p", po::value<std::vector<std::string>>()->composing(), "image to compute palette from, several images given by repeating it or by * and ? in file names share one palette (default: input and its variants)" )
     ( "require-palette,r", "report error if palette file does not exist (default: substitue input for palette if it does not exist)" )
     ( "save-optimal-palette,s", po::value<std::string>(), "saves optimal palette under given filename if it does not exist or is older than source palette (default: does nothing)" )
     ( "write-output-image,w", po::value<std::string>(), "write PNG image with reduced palette (default: does nothing)" )
     ( "separate-outputs,t", "write palette and sprite data to separate files (default: one file)" )
     ( "frame-width,f", po::value<int>(), "width of one frame of animation, must be a divisor of image width (default: image width)" )
+    ( "shared-pens,d", "frames of animation share one pen mapping and bits per pixel, written once to output while frame files hold only sprite data (default: pen mapping in every frame)" )
+    ( "unique-frames,U", "frames equal to an earlier frame or to its mirror image are packed once, unique frames are numbered in order and a table with .frm extension gives the unique frame, SPRCTL0 flip bits and position offsets of every frame (default: every frame packed)" )
+    ( "delta-frames,D", po::value<int>(), "frames are packed as the rectangle changed since the previous frame to be drawn over it, every given number of frames is a whole keyframe or only the first with 0, and a table with .dlt extension gives keyframes and offsets of frame sprites (default: whole frames)" )
+    ( "variants,z", po::value<std::vector<std::string>>()->composing(), "recolors of input given like palette images, each is drawn with the sprite data of input and gets only its pen mapping and palette written next to output under its own name (default: no variants)" )
     ( "max-colors,c", po::value<int>(), "maximal number of colors in the palette (default: 16)" )
+    ( "quantizer,q", po::value<std::string>(), "palette reduction algorithm: merge, median-cut or octree (default: merge)" )
+    ( "refine,k", po::value<int>(), "number of k-means iterations refining the reduced palette (default: 0)" )
+    ( "nearest-cache,n", po::value<std::string>(), "directory caching nearest color tables of palettes between runs (default: no table)" )
+    ( "lynx-histogram,y", "count palette colors in 4096 bins of Lynx 12-bit colors, bounding memory for noisy sources (default: distinct colors)" )
+    ( "banks,a", po::value<int>(), "number of palettes the palette images are grouped into with the least error, sprites use the palette of the bank mapping them best and -s saves every bank with its number appended and lists the bank of every image (default: 1)" )
+    ( "lynx-colors,e", "reduce and map colors as the 12-bit colors the Lynx displays, so no two pens have the same hardware color (default: 8-bit colors)" )
     ( "bpp,b", po::value<int>(), "forced bits per pixel (default: smallest possible)" )
     ( "literal,l", "do not compress sprite (default: off)" )
     ( "background,g", "sprite is a background sprite (first color does not need to be black/transparent (default: off)" )
     ( "verbose,v", "write verbose information to standard output (default: off)" )
+    ( "jobs,j", po::value<int>(), "number of threads packing sprites, frames and rows in parallel, 0 for all hardware threads (default: 1)" )
+    ( "memory-limit,u", po::value<int>(), "megabytes of decoded images held in memory at once, larger images are decoded row by row (default: 1024)" )
     ( "no-sprite-gen,x", "do not generate output sprite. Useful if only optimal palette is needed (default: off)" )
     ;
 
@@ -29,14 +86,14 @@ ProgramOptions::ProgramOptions( int argc, char const* argv[] )
     .add( "output", 1 );
 
 
-  if ( argc == 1 )
+  if ( args.empty() )
   {
     throw Ex{} << mDesc << "\n";
   }
 
   try
   {
-    po::store( po::command_line_parser( argc, argv ).options( mDesc ).positional( mPosDesc ).run(), mMap );
+    po::store( po::command_line_parser( args ).options( mDesc ).positional( mPosDesc ).run(), mMap );
     po::notify( mMap );
   }
   catch ( std::exception const& e )
@@ -49,6 +106,14 @@ ProgramOptions::ProgramOptions( int argc, char const* argv[] )
     throw Ex{} << mDesc << "\n";
   }
 
+  if ( mMap.count( "manifest" ) )
+  {
+    if ( mMap.count( "input" ) )
+      throw Ex{} << "Input file can't be specified with manifest.\n";
+
+    return;
+  }
+
   if ( !mMap.count( "input" ) )
   {
     throw Ex{} << "Input file not specified.\n";
@@ -62,22 +127,54 @@ ProgramOptions::ProgramOptions( int argc, char const* argv[] )
 
   mInput = std::filesystem::absolute( input );
 
-  if ( mMap.count( "palette" ) )
+  if ( mMap.count( "variants" ) )
   {
-    std::filesystem::path const palette = mMap["palette"].as<std::string>();
+    for ( std::string const& pattern : mMap["variants"].as<std::vector<std::string>>() )
+    {
+      std::vector<std::filesystem::path> const variants = expand( pattern );
+
+      if ( variants.empty() )
+        throw Ex{} << "Variant " << pattern << " does not exist.\n";
+
+      // a pattern matching the whole family matches the input too
+      for ( std::filesystem::path const& variant : variants )
+      {
+        std::filesystem::path const path = std::filesystem::absolute( variant );
+        if ( !std::filesystem::equivalent( path, mInput ) && std::find( mVariants.begin(), mVariants.end(), path ) == mVariants.end() )
+          mVariants.push_back( path );
+      }
+    }
+
+    if ( mMap.count( "frame-width" ) && !mMap.count( "shared-pens" ) )
+      throw Ex{} << "Variants of animation need frames sharing pens.\n";
+  }
 
-    if ( std::filesystem::exists( palette ) )
+  if ( mMap.count( "delta-frames" ) && mMap.count( "unique-frames" ) )
+    throw Ex{} << "Delta frames can't be combined with unique frames.\n";
+
+  if ( mMap.count( "palette" ) )
+  {
+    for ( std::string const& pattern : mMap["palette"].as<std::vector<std::string>>() )
     {
-      mPalette = std::filesystem::absolute( palette );
+      std::vector<std::filesystem::path> const palettes = expand( pattern );
+
+      if ( palettes.empty() && mMap.count( "require-palette" ) )
+        throw Ex{} << "Palette file does not exist.\n";
+
+      for ( std::filesystem::path const& palette : palettes )
+      {
+        mPalettes.push_back( std::filesystem::absolute( palette ) );
+      }
     }
   }
 
-  if ( mPalette.empty() )
+  if ( mPalettes.empty() )
   {
     if ( mMap.count( "require-palette" ) )
       throw Ex{} << "Palette file does not exist.\n";
 
-    mPalette = mInput;
+    mPalettes.push_back( mInput );
+    mPalettes.insert( mPalettes.end(), mVariants.begin(), mVariants.end() );
   }
 
   if ( mMap.count( "output" ) )
@@ -95,14 +192,24 @@ ProgramOptions::ProgramOptions( int argc, char const* argv[] )
 }
 
 
+std::optional<std::filesystem::path> ProgramOptions::manifest() const
+{
+  return mMap.count( "manifest" ) ? std::optional<std::filesystem::path>{ mMap["manifest"].as<std::string>() } : std::nullopt;
+}
+
 std::filesystem::path ProgramOptions::input() const
 {
   return mInput;
 }
 
-std::filesystem::path ProgramOptions::palette() const
+std::vector<std::filesystem::path> const& ProgramOptions::palettes() const
+{
+  return mPalettes;
+}
+
+std::vector<std::filesystem::path> const& ProgramOptions::variants() const
 {
-  return mPalette;
+  return mVariants;
 }
 
 std::optional<std::filesystem::path> ProgramOptions::optimalPalette() const
@@ -115,6 +222,11 @@ std::optional<std::filesystem::path> ProgramOptions::outputImage() const
   return mMap.count( "write-output-image" ) ? std::optional<std::filesystem::path>{ mMap["write-output-image"].as<std::string>() } : std::nullopt;
 }
 
+std::optional<std::filesystem::path> ProgramOptions::nearestCache() const
+{
+  return mMap.count( "nearest-cache" ) ? std::optional<std::filesystem::path>{ mMap["nearest-cache"].as<std::string>() } : std::nullopt;
+}
+
 std::optional<int> ProgramOptions::frameWidth() const
 {
   return mMap.count( "frame-width" ) ? std::optional<int>{ mMap["frame-width"].as<int>() } : std::nullopt;
@@ -139,6 +251,25 @@ int ProgramOptions::maxColors() const
   return 16;
 }
 
+std::string ProgramOptions::quantizer() const
+{
+  return mMap.count( "quantizer" ) ? mMap["quantizer"].as<std::string>() : std::string{ "merge" };
+}
+
+int ProgramOptions::refineIterations() const
+{
+  if ( mMap.count( "refine" ) )
+  {
+    int result = mMap["refine"].as<int>();
+    if ( result < 0 )
+      throw Ex{} << "Number of k-means iterations can't be negative.\n";
+
+    return result;
+  }
+
+  return 0;
+}
+
 std::optional<int> ProgramOptions::forcedBPP() const
 {
   if ( mMap.count( "bpp" ) )
@@ -152,6 +283,54 @@ std::optional<int> ProgramOptions::forcedBPP() const
   return std::nullopt;
 }
 
+bool ProgramOptions::sharedPens() const
+{
+  return mMap.count( "shared-pens" ) > 0;
+}
+
+bool ProgramOptions::uniqueFrames() const
+{
+  return mMap.count( "unique-frames" ) > 0;
+}
+
+std::optional<int> ProgramOptions::deltaFrames() const
+{
+  if ( mMap.count( "delta-frames" ) )
+  {
+    int result = mMap["delta-frames"].as<int>();
+    if ( result < 0 )
+      throw Ex{} << "Keyframe interval can't be negative.\n";
+
+    return result;
+  }
+
+  return std::nullopt;
+}
+
+bool ProgramOptions::lynxHistogram() const
+{
+  return mMap.count( "lynx-histogram" ) > 0;
+}
+
+int ProgramOptions::banks() const
+{
+  if ( mMap.count( "banks" ) )
+  {
+    int result = mMap["banks"].as<int>();
+    if ( result < 1 )
+      throw Ex{} << "Number of palette banks must be at least 1.\n";
+
+    return result;
+  }
+
+  return 1;
+}
+
+bool ProgramOptions::lynxColors() const
+{
+  return mMap.count( "lynx-colors" ) > 0;
+}
+
 bool ProgramOptions::literal() const
 {
   return mMap.count( "literal" ) > 0;
@@ -172,6 +351,34 @@ bool ProgramOptions::separateOutput() const
   return mMap.count( "separate-outputs" ) > 0;
 }
 
+int ProgramOptions::jobs() const
+{
+  if ( mMap.count( "jobs" ) )
+  {
+    int result = mMap["jobs"].as<int>();
+    if ( result < 0 )
+      throw Ex{} << "Number of jobs can't be negative.\n";
+
+    return result > 0 ? result : ( int )std::max( 1u, std::thread::hardware_concurrency() );
+  }
+
+  return 1;
+}
+
+size_t ProgramOptions::memoryLimit() const
+{
+  if ( mMap.count( "memory-limit" ) )
+  {
+    int result = mMap["memory-limit"].as<int>();
+    if ( result < 1 )
+      throw Ex{} << "Memory limit must be at least one megabyte.\n";
+
+    return ( size_t )result << 20;
+  }
+
+  return size_t{ 1024 } << 20;
+}
+
 bool ProgramOptions::noSpriteGen() const
 {
   return mMap.count( "no-sprite-gen" ) > 0;
@@ -5,26 +5,45 @@
 #include <filesystem>
 #include <memory>
 #include <optional>
+#include <vector>
 
 class ProgramOptions
 {
 public:
   ProgramOptions( int argc, char const* argv[] );
+  // arguments without the program name, e.g. one line of a manifest
+  ProgramOptions( std::vector<std::string> const& args );
   ProgramOptions( ProgramOptions const& ) = delete;
   ProgramOptions& operator=( ProgramOptions const& ) = delete;
 
+  std::optional<std::filesystem::path> manifest() const;
   std::filesystem::path input() const;
-  std::filesystem::path palette() const;
+  // sources of one palette, the input and its variants if no palette is given
+  std::vector<std::filesystem::path> const& palettes() const;
+  // recolors of the input sharing its sprite data
+  std::vector<std::filesystem::path> const& variants() const;
   std::optional<std::filesystem::path> optimalPalette() const;
   std::filesystem::path output() const;
   std::optional<std::filesystem::path> outputImage() const;
+  std::optional<std::filesystem::path> nearestCache() const;
   std::optional<int> frameWidth() const;
+  bool sharedPens() const;
+  bool uniqueFrames() const;
+  // interval of keyframes of delta frames
+  std::optional<int> deltaFrames() const;
   int maxColors() const;
+  std::string quantizer() const;
+  int refineIterations() const;
+  bool lynxHistogram() const;
+  bool lynxColors() const;
+  int banks() const;
   std::optional<int> forcedBPP() const;
   bool literal() const;
   bool backround() const;
   bool verbose() const;
   bool separateOutput() const;
+  int jobs() const;
+  size_t memoryLimit() const;
   bool noSpriteGen() const;
 
 private:
@@ -33,6 +52,7 @@ private:
   boost::program_options::positional_options_description mPosDesc = {};
 
   std::filesystem::path mInput = {};
-  std::filesystem::path mPalette = {};
+  std::vector<std::filesystem::path> mPalettes = {};
+  std::vector<std::filesystem::path> mVariants = {};
   std::filesystem::path mOutput = {};
 };
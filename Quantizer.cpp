@@ -0,0 +1,570 @@
+#include "Quantizer.hpp"
+#include "Ex.hpp"
+#include "ThreadPool.hpp"
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <limits>
+
+namespace
+{
+
+class ColorSet
+{
+public:
+  ColorSet( Color c )
+  {
+    add( c );
+  }
+
+  void add( Color c )
+  {
+    if ( c )
+    {
+      mR += c.r();
+      mG += c.g();
+      mB += c.b();
+      mA += c.a();
+      mCount += 1;
+      update();
+    }
+  }
+
+  void merge( ColorSet const& other )
+  {
+    mR += other.mR;
+    mG += other.mG;
+    mB += other.mB;
+    mA += other.mA;
+    mCount += other.mCount;
+    update();
+  }
+
+  Color mean() const
+  {
+    return mMeanColor;
+  }
+
+private:
+  void update()
+  {
+    if ( mCount > 0 )
+    {
+      mMeanColor = { ( uint8_t )( mR / mCount ), ( uint8_t )( mG / mCount ), ( uint8_t )( mB / mCount ), ( uint8_t )( mA / mCount ) };
+    }
+  }
+
+  // running sums of member colors, transparent colors are not members
+  int64_t mR = 0;
+  int64_t mG = 0;
+  int64_t mB = 0;
+  int64_t mA = 0;
+  int64_t mCount = 0;
+  Color mMeanColor = {};
+};
+
+// Repeatedly merges the closest pair of sets with different means until maxColors sets are left.
+// Of equally close pairs the one with the lowest indices is merged into the set with the lower index.
+// Every set caches its nearest neighbour and the candidate pairs are kept in a heap, so only sets whose neighbour was merged are searched again.
+// Nearest neighbours are searched in a grid of 16x16x16 cells over the mean colors.
+class Reducer
+{
+public:
+  Reducer( std::vector<ColorSet> colorSets ) : mSets{ std::move( colorSets ) }, mAlive( mSets.size(), true ), mVersion( mSets.size(), 0 ), mCells( CELLS * CELLS * CELLS ), mHeap{}
+  {
+    for ( size_t i = 0; i < mSets.size(); ++i )
+    {
+      mCells[cell( mSets[i].mean() )].push_back( i );
+    }
+
+    for ( size_t i = 0; i < mSets.size(); ++i )
+    {
+      push( i );
+    }
+  }
+
+  std::vector<ColorSet> reduce( size_t maxColors )
+  {
+    for ( size_t size = mSets.size(); size > maxColors; )
+    {
+      if ( mHeap.empty() )
+      {
+        throw Ex{} << "Palette can't be reduced to " << maxColors << " colors";
+      }
+
+      std::pop_heap( mHeap.begin(), mHeap.end(), std::greater<Candidate>{} );
+      Candidate c = mHeap.back();
+      mHeap.pop_back();
+
+      if ( !mAlive[c.from] || mVersion[c.from] != c.fromVersion )
+        continue;
+
+      if ( !mAlive[c.to] || mVersion[c.to] != c.toVersion )
+      {
+        push( c.from );
+        continue;
+      }
+
+      size_t dst = c.lo;
+      size_t src = c.hi;
+
+      remove( dst );
+      remove( src );
+      mSets[dst].merge( mSets[src] );
+      mAlive[src] = false;
+      mVersion[dst] += 1;
+      mCells[cell( mSets[dst].mean() )].push_back( dst );
+      push( dst );
+      size -= 1;
+    }
+
+    std::vector<ColorSet> result;
+    for ( size_t i = 0; i < mSets.size(); ++i )
+    {
+      if ( mAlive[i] )
+        result.push_back( mSets[i] );
+    }
+    return result;
+  }
+
+private:
+  static constexpr int CELL_BITS = 4;
+  static constexpr int CELLS = 256 >> CELL_BITS;
+
+  struct Candidate
+  {
+    int dist;
+    size_t lo;
+    size_t hi;
+    size_t from;
+    size_t to;
+    uint32_t fromVersion;
+    uint32_t toVersion;
+
+    friend bool operator>( Candidate const& left, Candidate const& right )
+    {
+      if ( left.dist != right.dist )
+        return left.dist > right.dist;
+      if ( left.lo != right.lo )
+        return left.lo > right.lo;
+      return left.hi > right.hi;
+    }
+  };
+
+  static size_t cell( int r, int g, int b )
+  {
+    return ( ( size_t )r * CELLS + g ) * CELLS + b;
+  }
+
+  static size_t cell( Color c )
+  {
+    return cell( c.r() >> CELL_BITS, c.g() >> CELL_BITS, c.b() >> CELL_BITS );
+  }
+
+  // squared distance from a color channel to the nearest value inside cell number i
+  static int cellDist( int value, int i )
+  {
+    int d = std::max( { ( i << CELL_BITS ) - value, value - ( ( i + 1 ) << CELL_BITS ) + 1, 0 } );
+    return d * d;
+  }
+
+  void remove( size_t i )
+  {
+    auto& ids = mCells[cell( mSets[i].mean() )];
+    ids.erase( std::find( ids.begin(), ids.end(), i ) );
+  }
+
+  // pushes the closest pair the set is member of, searching cells in growing cubes around the set's cell
+  void push( size_t i )
+  {
+    Color const m = mSets[i].mean();
+    int const cr = m.r() >> CELL_BITS;
+    int const cg = m.g() >> CELL_BITS;
+    int const cb = m.b() >> CELL_BITS;
+
+    Candidate best{ std::numeric_limits<int>::max(), ~size_t{}, ~size_t{}, i, ~size_t{}, mVersion[i], 0 };
+
+    for ( int r = 0; r < CELLS; ++r )
+    {
+      if ( r > 0 )
+      {
+        int gap = ( ( r - 1 ) << CELL_BITS ) + 1;
+        if ( gap * gap > best.dist )
+          break;
+      }
+
+      auto visit = [&]( int x, int y, int z, int dxy )
+      {
+        if ( dxy + cellDist( m.b(), z ) > best.dist )
+          return;
+
+        for ( size_t j : mCells[cell( x, y, z )] )
+        {
+          if ( int d = dist( m, mSets[j].mean() ) )
+          {
+            Candidate c{ d, std::min( i, j ), std::max( i, j ), i, j, mVersion[i], mVersion[j] };
+            if ( best > c )
+              best = c;
+          }
+        }
+      };
+
+      for ( int x = std::max( cr - r, 0 ); x <= std::min( cr + r, CELLS - 1 ); ++x )
+      {
+        for ( int y = std::max( cg - r, 0 ); y <= std::min( cg + r, CELLS - 1 ); ++y )
+        {
+          int const dxy = cellDist( m.r(), x ) + cellDist( m.g(), y );
+          if ( std::abs( x - cr ) == r || std::abs( y - cg ) == r )
+          {
+            for ( int z = std::max( cb - r, 0 ); z <= std::min( cb + r, CELLS - 1 ); ++z )
+            {
+              visit( x, y, z, dxy );
+            }
+          }
+          else
+          {
+            if ( cb - r >= 0 )
+              visit( x, y, cb - r, dxy );
+            if ( cb + r < CELLS )
+              visit( x, y, cb + r, dxy );
+          }
+        }
+      }
+    }
+
+    if ( best.to != ~size_t{} )
+    {
+      mHeap.push_back( best );
+      std::push_heap( mHeap.begin(), mHeap.end(), std::greater<Candidate>{} );
+    }
+  }
+
+  std::vector<ColorSet> mSets;
+  std::vector<bool> mAlive;
+  std::vector<uint32_t> mVersion;
+  std::vector<std::vector<size_t>> mCells;
+  std::vector<Candidate> mHeap;
+};
+
+// splits off transparent color which always takes its own palette entry
+std::vector<WeightedColor> opaqueColors( std::vector<WeightedColor> const& colors, std::vector<Color>& result, int& maxColors )
+{
+  std::vector<WeightedColor> opaque;
+  opaque.reserve( colors.size() );
+
+  for ( auto const& wc : colors )
+  {
+    if ( wc.color )
+    {
+      opaque.push_back( wc );
+    }
+    else if ( result.empty() )
+    {
+      result.push_back( Color{} );
+      maxColors -= 1;
+    }
+  }
+
+  return opaque;
+}
+
+int channel( Color c, int axis )
+{
+  return axis == 0 ? c.r() : axis == 1 ? c.g() : c.b();
+}
+
+class MergeQuantizer : public Quantizer
+{
+public:
+  std::vector<Color> reduce( std::vector<WeightedColor> const& colors, int maxColors ) const override
+  {
+    std::vector<ColorSet> colorSets;
+    colorSets.reserve( colors.size() );
+    for ( auto const& wc : colors )
+    {
+      colorSets.push_back( wc.color );
+    }
+
+    std::vector<Color> result;
+    for ( auto const& cs : Reducer{ std::move( colorSets ) }.reduce( maxColors ) )
+    {
+      result.push_back( cs.mean() );
+    }
+    return result;
+  }
+};
+
+// Splits the box of colors with the largest weighted squared error along its widest channel at the weighted median until there are maxColors boxes
+class MedianCutQuantizer : public Quantizer
+{
+  struct Box
+  {
+    size_t begin;
+    size_t end;
+    int axis;
+    double error;
+  };
+
+  static Box makeBox( std::vector<WeightedColor> const& colors, size_t begin, size_t end )
+  {
+    Box box{ begin, end, 0, 0.0 };
+
+    for ( int axis = 0; axis < 3; ++axis )
+    {
+      double sum = 0;
+      double sumSq = 0;
+      double count = 0;
+      for ( size_t i = begin; i < end; ++i )
+      {
+        double v = channel( colors[i].color, axis );
+        sum += v * colors[i].count;
+        sumSq += v * v * colors[i].count;
+        count += colors[i].count;
+      }
+
+      double error = sumSq - sum * sum / count;
+      if ( end - begin > 1 && error > box.error )
+      {
+        box.error = error;
+        box.axis = axis;
+      }
+    }
+
+    return box;
+  }
+
+public:
+  std::vector<Color> reduce( std::vector<WeightedColor> const& colors, int maxColors ) const override
+  {
+    std::vector<Color> result;
+    std::vector<WeightedColor> opaque = opaqueColors( colors, result, maxColors );
+
+    std::vector<Box> boxes;
+    if ( !opaque.empty() && maxColors > 0 )
+      boxes.push_back( makeBox( opaque, 0, opaque.size() ) );
+
+    while ( ( int )boxes.size() < maxColors )
+    {
+      auto it = std::max_element( boxes.begin(), boxes.end(), []( Box const& left, Box const& right )
+      {
+        return left.error < right.error;
+      } );
+
+      if ( it->error <= 0 )
+        break;
+
+      Box box = *it;
+      int const axis = box.axis;
+      std::sort( opaque.begin() + box.begin, opaque.begin() + box.end, [axis]( WeightedColor const& left, WeightedColor const& right )
+      {
+        return channel( left.color, axis ) < channel( right.color, axis );
+      } );
+
+      uint64_t total = 0;
+      for ( size_t i = box.begin; i < box.end; ++i )
+      {
+        total += opaque[i].count;
+      }
+
+      size_t split = box.begin;
+      for ( uint64_t acc = 0; split < box.end - 1 && acc + opaque[split].count <= total / 2; ++split )
+      {
+        acc += opaque[split].count;
+      }
+      split = std::max( split, box.begin + 1 );
+
+      *it = makeBox( opaque, box.begin, split );
+      boxes.push_back( makeBox( opaque, split, box.end ) );
+    }
+
+    for ( auto const& box : boxes )
+    {
+      ColorSum sum;
+      for ( size_t i = box.begin; i < box.end; ++i )
+      {
+        sum.add( opaque[i].color, opaque[i].count );
+      }
+      result.push_back( sum.mean() );
+    }
+
+    return result;
+  }
+};
+
+// Builds an octree of colors and folds the leaves of the least populated nodes at the deepest level into their parent until there are maxColors leaves
+class OctreeQuantizer : public Quantizer
+{
+  struct Node
+  {
+    std::array<int, 8> children;
+    int level;
+    ColorSum sum;
+  };
+
+public:
+  std::vector<Color> reduce( std::vector<WeightedColor> const& colors, int maxColors ) const override
+  {
+    std::vector<Color> result;
+    std::vector<WeightedColor> opaque = opaqueColors( colors, result, maxColors );
+
+    if ( opaque.empty() || maxColors <= 0 )
+      return result;
+
+    std::vector<Node> nodes;
+    nodes.push_back( Node{ { -1, -1, -1, -1, -1, -1, -1, -1 }, 0, {} } );
+    int leaves = 0;
+
+    for ( auto const& wc : opaque )
+    {
+      int node = 0;
+      nodes[node].sum.add( wc.color, wc.count );
+      for ( int level = 0; level < 8; ++level )
+      {
+        int const shift = 7 - level;
+        int const child = ( ( wc.color.r() >> shift ) & 1 ) << 2 | ( ( wc.color.g() >> shift ) & 1 ) << 1 | ( ( wc.color.b() >> shift ) & 1 );
+        if ( nodes[node].children[child] < 0 )
+        {
+          nodes[node].children[child] = ( int )nodes.size();
+          nodes.push_back( Node{ { -1, -1, -1, -1, -1, -1, -1, -1 }, level + 1, {} } );
+          if ( level == 7 )
+            leaves += 1;
+        }
+        node = nodes[node].children[child];
+        nodes[node].sum.add( wc.color, wc.count );
+      }
+    }
+
+    std::array<std::vector<int>, 8> levels;
+    for ( int i = 0; i < ( int )nodes.size(); ++i )
+    {
+      if ( nodes[i].level < 8 )
+        levels[nodes[i].level].push_back( i );
+    }
+
+    for ( int level = 7; level >= 0 && leaves > maxColors; --level )
+    {
+      std::stable_sort( levels[level].begin(), levels[level].end(), [&]( int left, int right )
+      {
+        return nodes[left].sum.count < nodes[right].sum.count;
+      } );
+
+      for ( int node : levels[level] )
+      {
+        if ( leaves <= maxColors )
+          break;
+
+        for ( int& child : nodes[node].children )
+        {
+          if ( child >= 0 )
+          {
+            leaves -= 1;
+            child = -1;
+          }
+        }
+        leaves += 1;
+      }
+    }
+
+    std::vector<int> stack{ 0 };
+    while ( !stack.empty() )
+    {
+      int node = stack.back();
+      stack.pop_back();
+
+      bool leaf = true;
+      for ( int i = 7; i >= 0; --i )
+      {
+        if ( nodes[node].children[i] >= 0 )
+        {
+          stack.push_back( nodes[node].children[i] );
+          leaf = false;
+        }
+      }
+
+      if ( leaf )
+        result.push_back( nodes[node].sum.mean() );
+    }
+
+    return result;
+  }
+};
+
+}
+
+std::unique_ptr<Quantizer> Quantizer::create( std::string const& name )
+{
+  if ( name == "merge" )
+    return std::make_unique<MergeQuantizer>();
+  if ( name == "median-cut" )
+    return std::make_unique<MedianCutQuantizer>();
+  if ( name == "octree" )
+    return std::make_unique<OctreeQuantizer>();
+
+  throw Ex{} << "Unknown quantizer " << name << ". Use merge, median-cut or octree.\n";
+}
+
+std::vector<Color> refineKMeans( std::vector<WeightedColor> const& colors, std::vector<Color> palette, int iterations )
+{
+  size_t const threads = std::clamp<size_t>( colors.size() / 4096, 1, ThreadPool::instance().threads() );
+  size_t const chunk = ( colors.size() + threads - 1 ) / threads;
+
+  for ( int iteration = 0; iteration < iterations; ++iteration )
+  {
+    std::vector<std::vector<ColorSum>> sums( threads, std::vector<ColorSum>( palette.size() ) );
+
+    auto assign = [&]( size_t t )
+    {
+      for ( size_t i = t * chunk; i < std::min( colors.size(), ( t + 1 ) * chunk ); ++i )
+      {
+        if ( !colors[i].color )
+          continue;
+
+        int minDist = std::numeric_limits<int>::max();
+        size_t idx = palette.size();
+        for ( size_t j = 0; j < palette.size(); ++j )
+        {
+          int d = dist( palette[j], colors[i].color );
+          if ( palette[j] && d < minDist )
+          {
+            minDist = d;
+            idx = j;
+          }
+        }
+
+        if ( idx < palette.size() )
+          sums[t][idx].add( colors[i].color, colors[i].count );
+      }
+    };
+
+    TaskGroup group;
+    for ( size_t t = 0; t < threads; ++t )
+    {
+      group.run( [&assign, t]
+      {
+        assign( t );
+      } );
+    }
+    group.wait();
+
+    bool changed = false;
+    for ( size_t j = 0; j < palette.size(); ++j )
+    {
+      for ( size_t t = 1; t < threads; ++t )
+      {
+        sums[0][j].add( sums[t][j] );
+      }
+
+      if ( palette[j] && sums[0][j].count > 0 )
+      {
+        Color mean = sums[0][j].mean();
+        changed |= mean.key() != palette[j].key();
+        palette[j] = mean;
+      }
+    }
+
+    if ( !changed )
+      break;
+  }
+
+  return palette;
+}
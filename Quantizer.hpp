@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "Color.hpp"
+
+// distinct color of the palette source and the number of its pixels
+struct WeightedColor
+{
+  Color color;
+  uint32_t count;
+};
+
+// weighted sums of colors
+struct ColorSum
+{
+  int64_t r = 0;
+  int64_t g = 0;
+  int64_t b = 0;
+  int64_t a = 0;
+  int64_t count = 0;
+
+  void add( Color c, uint32_t weight )
+  {
+    r += ( int64_t )c.r() * weight;
+    g += ( int64_t )c.g() * weight;
+    b += ( int64_t )c.b() * weight;
+    a += ( int64_t )c.a() * weight;
+    count += weight;
+  }
+
+  void add( ColorSum const& other )
+  {
+    r += other.r;
+    g += other.g;
+    b += other.b;
+    a += other.a;
+    count += other.count;
+  }
+
+  Color mean() const
+  {
+    return { ( uint8_t )( r / count ), ( uint8_t )( g / count ), ( uint8_t )( b / count ), ( uint8_t )( a / count ) };
+  }
+};
+
+class Quantizer
+{
+public:
+  virtual ~Quantizer() = default;
+
+  // reduces colors to at most maxColors colors, transparent color is passed as Color{}
+  virtual std::vector<Color> reduce( std::vector<WeightedColor> const& colors, int maxColors ) const = 0;
+
+  // "merge", "median-cut" or "octree"
+  static std::unique_ptr<Quantizer> create( std::string const& name );
+};
+
+// moves every opaque palette color to the weighted mean of the colors nearest to it, assignment is split into tasks of the thread pool
+std::vector<Color> refineKMeans( std::vector<WeightedColor> const& colors, std::vector<Color> palette, int iterations );
@@ -2,351 +2,609 @@
 #include "Ex.hpp"
 #include "Color.hpp"
 #include "Log.hpp"
+#include "ColorMap.hpp"
+#include "ThreadPool.hpp"
+#include "SpriteRow.hpp"
 #include <cassert>
-#include <fstream>
-#include <functional>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <array>
+#include <span>
 #include "lodepng.h"
 
 namespace
 {
 
-class BitAssembler
+// Pens of one frame, one byte per pixel with rows stored contiguously
+struct PenPlane
 {
-  std::vector<uint8_t> buffer;
-  int accum;
-  int size;
-public:
+  int width;
+  int height;
+  std::vector<uint8_t> pens;
 
-  BitAssembler() : buffer{}, accum{}, size{}
+  std::span<uint8_t const> row( int y ) const
   {
+    return { pens.data() + ( size_t )y * width, ( size_t )width };
   }
+};
 
-  ~BitAssembler()
-  {
-    assert( size == 0 );
-  }
+// rows of one packing task, tall frames are split into several tasks
+int const ROWS_PER_TASK = 64;
 
-  void shift( int bits, int value )
+// Encodes rows from begin up to end without the terminating zero byte
+template<int bpp>
+void encodeRows( PenPlane const& plane, int begin, int end, bool literal, bool verbose, std::vector<uint8_t>& literalData, std::vector<uint8_t>& packedData )
+{
+  if ( literal || verbose )
   {
-    assert( bits > 0 );
-    while ( bits > 0 )
+    for ( int y = begin; y < end; ++y )
     {
-      if ( size + bits >= 8 )
-      {
-        accum <<= 8 - size;
-        accum |= value >> ( bits - 8 + size );
-        value &= ( 1 << ( bits - 8 + size ) ) - 1;
-        bits -= 8 - size;
-        buffer.push_back( accum );
-        accum = size = 0;
-      }
-      else
-      {
-        accum <<= bits;
-        accum |= value;
-        size += bits;
-        break;
-      }
+      SpriteRow row = SpriteRow::literal<bpp>( plane.row( y ) );
+      literalData.push_back( ( uint8_t )row.size() + 1 );
+      literalData.insert( literalData.end(), row.begin(), row.end() );
     }
   }
 
-  void flushRow( bool literal = false )
+  if ( !literal || verbose )
   {
-    if ( size > 0 )
+    for ( int y = begin; y < end; ++y )
     {
-      accum <<= 8 - size;
-      buffer.push_back( accum );
-      accum = size = 0;
+      SpriteRow row = SpriteRow::packed<bpp>( plane.row( y ) );
+      packedData.push_back( ( uint8_t )row.size() + 1 );
+      packedData.insert( packedData.end(), row.begin(), row.end() );
     }
-    else if ( !literal )
+  }
+}
+
+void encodeRows( int bpp, PenPlane const& plane, int begin, int end, bool literal, bool verbose, std::vector<uint8_t>& literalData, std::vector<uint8_t>& packedData )
+{
+  switch ( bpp )
+  {
+  case 1:
+    encodeRows<1>( plane, begin, end, literal, verbose, literalData, packedData );
+    break;
+  case 2:
+    encodeRows<2>( plane, begin, end, literal, verbose, literalData, packedData );
+    break;
+  case 3:
+    encodeRows<3>( plane, begin, end, literal, verbose, literalData, packedData );
+    break;
+  default:
+    encodeRows<4>( plane, begin, end, literal, verbose, literalData, packedData );
+    break;
+  }
+}
+
+// palette index of every pen
+std::vector<int> paletteIndices( std::vector<Color> const& colorsUsed, std::vector<Color> const& originalColors )
+{
+  std::vector<int> mapping{};
+  mapping.reserve( 16 );
+
+  for ( auto color : colorsUsed )
+  {
+    auto it = std::find( originalColors.cbegin(), originalColors.cend(), color );
+    if ( it == originalColors.cend() )
     {
-      // There is a bug in the hardware that requires that the last meaningful bit of the data packet at the end of a scan line does not occur in the last bit of a byte (bit 0).
-      // This means that the data packet creation process must check for this case, and if found, must pad this data packet with a byte of all 0s.
-      buffer.push_back( 0 );
+      throw Ex{} << "Palette processing error";
     }
+    mapping.push_back( ( int )std::distance( originalColors.cbegin(), it ) );
   }
 
-  std::vector<uint8_t> const& getData() const
+  return mapping;
+}
+
+// Pen mapping table of the SCB, the palette index of every pen packed two pens to a byte
+std::vector<uint8_t> penMapping( std::vector<int> const& mapping )
+{
+  std::vector<uint8_t> penMapping = std::vector<uint8_t>( ( mapping.size() + 1 ) / 2, 0 );
+
+  for ( int i = 0; i < ( int )mapping.size(); ++i )
   {
-    return buffer;
+    penMapping[i / 2] |= mapping[i] << ( ( i % 2 == 0 ) ? 4 : 0 );
   }
 
-  void update( size_t offset, uint8_t value )
+  return penMapping;
+}
+
+// Appends the pen mapping table followed by green and blue-red palette data
+void appendPalette( std::vector<uint8_t>& sprite, std::vector<uint8_t> const& penMapping, std::vector<Color> const& originalColors )
+{
+  size_t off = sprite.size();
+
+  sprite.insert( sprite.end(), penMapping.begin(), penMapping.end() );
+  LOG << sprite.size() - off << " bytes of pen mapping data written at offset " << off;
+
+  off = sprite.size();
+
+  for ( auto const& color : originalColors )
   {
-    assert( offset < buffer.size() );
-    buffer[offset] = value;
+    sprite.push_back( color.g4() );
   }
+  LOG << sprite.size() - off << " bytes of green palette data written at offset " << off;
 
-};
+  off = sprite.size();
 
+  for ( auto const& color : originalColors )
+  {
+    sprite.push_back( color.br4() );
+  }
+  LOG << sprite.size() - off << " bytes of blue and red palette data written at offset " << off;
+}
 
-class SpriteRow
+// Pen mapping table and palette as assembler source with .pal extension
+OutputFile paletteText( std::filesystem::path path, std::vector<uint8_t> const& penMapping, std::vector<Color> const& originalColors )
 {
-  explicit SpriteRow() : bitAssembler{}
+  path.replace_extension( ".pal" );
+  std::stringstream fout;
+
+  fout << "redir:\t.byte ";
+  bool firstRedir = true;
+
+  for ( auto const& pen : penMapping )
   {
+    if ( firstRedir )
+      firstRedir = false;
+    else
+      fout << ',';
+    fout << " $" << std::hex << std::setfill( '0' ) << std::setw( 2 ) << ( int )pen;
   }
 
-  SpriteRow( BitAssembler bitAssembler ) : bitAssembler{ std::move( bitAssembler ) }
+  fout << '\n';
+
+  fout << "pal:\t.word ";
+  bool firstPal = true;
+
+  for ( auto const& color : originalColors )
   {
+    if ( firstPal )
+      firstPal = false;
+    else
+      fout << ',';
+    fout << " $" << color.str();
   }
 
-  BitAssembler bitAssembler;
+  fout << '\n';
 
-public:
+  std::string const text = fout.str();
+  LOG << "Palette data written to " << path;
+  return OutputFile{ path, std::vector<uint8_t>( text.begin(), text.end() ), true };
+}
+
+// SPRCTL0 bits drawing a sprite mirrored
+uint8_t const HFLIP = 0x20;
+uint8_t const VFLIP = 0x10;
+
+// Hashes of the colors of a frame as it is, flipped vertically, horizontally and both, so the index is a combination of 1 for vertical and 2 for horizontal flip.
+// Every row is hashed from both ends and row hashes are combined from both ends
+std::array<uint64_t, 4> frameHashes( Image const& image, Bounds const& bounds )
+{
+  uint64_t const BASIS = 0xcbf29ce484222325ull;
+  uint64_t const PRIME = 0x100000001b3ull;
+
+  int const width = bounds.maxx - bounds.minx + 1;
+  int const height = bounds.maxy - bounds.miny + 1;
+  std::vector<uint64_t> forward( height );
+  std::vector<uint64_t> backward( height );
 
-  static SpriteRow packed( int bpp, ImageRow const& row, std::function<int( Color )> mapper )
+  for ( int y = 0; y < height; ++y )
   {
-    struct TempBuffer
+    uint64_t f = BASIS;
+    uint64_t b = BASIS;
+    for ( int x = 0; x < width; ++x )
     {
-      TempBuffer( size_t pensSize ) : cmds{}, pens{}
-      {
-        pens.reserve( pensSize );
-      }
+      f = ( f ^ image( bounds.minx + x, bounds.miny + y ).key() ) * PRIME;
+      b = ( b ^ image( bounds.maxx - x, bounds.miny + y ).key() ) * PRIME;
+    }
+    forward[y] = f;
+    backward[y] = b;
+  }
 
-      struct Cmd
-      {
-        bool rle;
-        int off;
-        int size;
-      };
+  std::array<uint64_t, 4> result;
+  result.fill( BASIS );
+  for ( int y = 0; y < height; ++y )
+  {
+    result[0] = ( result[0] ^ forward[y] ) * PRIME;
+    result[1] = ( result[1] ^ forward[height - 1 - y] ) * PRIME;
+    result[2] = ( result[2] ^ backward[y] ) * PRIME;
+    result[3] = ( result[3] ^ backward[height - 1 - y] ) * PRIME;
+  }
+
+  return result;
+}
+
+// whether frame equals the other frame flipped as in frameHashes
+bool sameFrames( Image const& image, Bounds const& frame, Bounds const& other, int flip )
+{
+  int const width = frame.maxx - frame.minx + 1;
+  int const height = frame.maxy - frame.miny + 1;
+
+  for ( int y = 0; y < height; ++y )
+  {
+    int const oy = ( flip & 1 ) ? height - 1 - y : y;
+    for ( int x = 0; x < width; ++x )
+    {
+      int const ox = ( flip & 2 ) ? width - 1 - x : x;
+      if ( image( frame.minx + x, frame.miny + y ).key() != image( other.minx + ox, other.miny + oy ).key() )
+        return false;
+    }
+  }
+
+  return true;
+}
+
+// Pen mapping table and palette without sprite data, binary or as assembler source
+std::vector<OutputFile> paletteFiles( std::vector<uint8_t> const& penMapping, std::vector<Color> const& originalColors, std::filesystem::path output, bool separateFiles )
+{
+  if ( separateFiles )
+    return { paletteText( std::move( output ), penMapping, originalColors ) };
 
-      std::vector<Cmd> cmds;
-      std::vector<uint8_t> pens;
+  LOG << "Writing pen mapping and palette to " << output;
 
+  std::vector<uint8_t> data;
+  appendPalette( data, penMapping, originalColors );
+  return { OutputFile{ std::move( output ), std::move( data ), false } };
+}
 
-      void tokenize()
+}
+
+std::vector<FrameColors> analyzeFrames( Image const& image, std::vector<Bounds> const& frames )
+{
+  std::vector<FrameColors> result( frames.size() );
+
+  if ( image.indexed() )
+  {
+    // pixels are counted by palette index and indices of the same color are merged afterwards
+    std::vector<std::array<uint32_t, 256>> counts( frames.size() );
+    image.eachIndexRow( [&]( int y, std::span<uint8_t const> row )
+    {
+      for ( size_t i = 0; i < frames.size(); ++i )
       {
-        int streak{};
-        bool rle{};
-        for ( size_t i = 0; i < pens.size(); ++i, ++streak )
-        {
-          switch ( streak )
-          {
-          case 0:
-            rle = false;
-            break;
-          case 1:
-            rle = pens[i - 1] == pens[i];
-            break;
-          default:
-            if ( ( pens[i - 1] == pens[i] ) ^ rle )
-            {
-              Cmd cmd{ rle, ( int )( i - streak ), streak - ( rle ? 0 : 1 ) };
-              cmds.push_back( cmd );
-              streak = rle ? 0 : 1;
-              rle = !rle;
-            }
-            break;
-          }
-        }
-        if ( cmds.empty() || cmds.back().off + cmds.back().size < ( int )pens.size() )
+        Bounds const& bounds = frames[i];
+        if ( y < bounds.miny || y > bounds.maxy )
+          continue;
+
+        for ( uint8_t index : row.subspan( bounds.minx, bounds.maxx - bounds.minx + 1 ) )
         {
-          Cmd cmd{ rle, ( int )( pens.size() - streak ), streak };
-          cmds.push_back( cmd );
+          counts[i][index] += 1;
         }
       }
+    } );
 
-      Cmd optimize( int off, Cmd const* beg, Cmd const* end )
+    std::vector<Color> const& palette = image.palette();
+    for ( size_t i = 0; i < frames.size(); ++i )
+    {
+      for ( size_t index = 0; index < palette.size(); ++index )
       {
-        uint32_t optScore = ~0;
-        uint32_t optPerm = 0;
+        if ( counts[i][index] == 0 )
+          continue;
 
-        auto size = [off]( Cmd const* it )
+        result[i].findOrInsert( palette[index], []( Color )
         {
-          int result = it->size - std::max( off - it->off, 0 );
-          result = std::min( result, 16 );
-          return result;
-        };
+          return 0u;
+        } ) += counts[i][index];
+      }
+    }
 
-        for ( int perm = 0;; ++perm )
-        {
-          bool literal = false;
-          int idx = 0;
-          uint32_t score = 0;
-
-          for ( auto it = beg; it != end; ++it )
-          {
-            if ( it->rle )
-            {
-              if ( ( perm & ( 1 << idx++ ) ) == 0 )
-              {
-                if ( literal )
-                {
-                  score += size( it ) * 4;
-                }
-                else
-                {
-                  literal = true;
-                  score += 4 + 1 + size( it ) * 4;
-                }
-              }
-              else
-              {
-                score += 9;
-                literal = false;
-              }
-            }
-            else
-            {
-              if ( literal )
-              {
-                score += size( it ) * 4;
-              }
-              else
-              {
-                literal = true;
-                score += 4 + 1 + size( it ) * 4;
-              }
-            }
-          }
-
-          if ( score < optScore )
-          {
-            optScore = score;
-            optPerm = perm;
-          }
-
-          if ( perm >= ( 1 << idx ) - 1 )
-            break;
-        }
+    return result;
+  }
 
-        Cmd cmd{ false, off, 0 };
+  image.eachRow( [&]( int y, std::span<Color const> row )
+  {
+    for ( size_t i = 0; i < frames.size(); ++i )
+    {
+      Bounds const& bounds = frames[i];
+      if ( y < bounds.miny || y > bounds.maxy )
+        continue;
 
-        int idx = 0;
-        bool literal = false;
-        for ( auto it = beg; it != end; ++it )
+      std::span<Color const> src = row.subspan( bounds.minx, bounds.maxx - bounds.minx + 1 );
+      for ( size_t x = 0; x < src.size(); )
+      {
+        size_t end = x + 1;
+        while ( end < src.size() && src[end].key() == src[x].key() )
         {
-          if ( it->rle && ( optPerm & ( 1 << idx++ ) ) != 0 )
-          {
-            if ( literal )
-            {
-              return cmd;
-            }
-            cmd.rle = true;
-            cmd.size = size( it );
-            return cmd;
-          }
-          else
-          {
-            literal = true;
-            cmd.size += size( it );
-            if ( cmd.size >= 16 )
-            {
-              cmd.size = 16;
-              return cmd;
-            }
-          }
+          ++end;
         }
 
-        return cmd;
+        result[i].findOrInsert( src[x], []( Color )
+        {
+          return 0u;
+        } ) += ( uint32_t )( end - x );
+        x = end;
       }
+    }
+  } );
 
+  return result;
+}
 
-      void optimize()
+std::optional<ColorMap<Color>> recolorOf( Image const& image, Image const& variant )
+{
+  if ( image.width() != variant.width() || image.height() != variant.height() )
+    return std::nullopt;
+
+  // colors of the variant by colors of the image and back, so no two colors merge into one
+  ColorMap<Color> recolor;
+  ColorMap<Color> original;
+  bool same = true;
+
+  image.eachRow( [&]( int y, std::span<Color const> row )
+  {
+    for ( size_t x = 0; same && x < row.size(); ++x )
+    {
+      Color const c = row[x];
+      Color const v = variant( ( int )x, y );
+      Color const mapped = recolor.findOrInsert( c, [&]( Color )
+      {
+        return v;
+      } );
+      Color const back = original.findOrInsert( v, [&]( Color )
       {
-        std::vector<Cmd> result;
+        return c;
+      } );
+      same = mapped.key() == v.key() && back.key() == c.key();
+    }
+  } );
 
-        int off = 0;
-        for ( auto it = cmds.cbegin(); it < cmds.cend(); )
-        {
-          assert( off >= it->off );
-          for ( auto jt = it; jt < cmds.cend(); ++jt )
-          {
-            if ( jt + 1 == cmds.cend() || jt->off - off >= 16 )
-            {
-              Cmd cmd = optimize( off, &*it, &*jt + ( jt + 1 == cmds.cend() ? 1 : 0 ) );
-              off += cmd.size;
-              result.push_back( cmd );
-
-              for ( ; it < cmds.cend(); ++it )
-              {
-                if ( it->off + it->size > off )
-                {
-                  break;
-                }
-              }
-              break;
-            }
-          }
-        }
+  if ( !same )
+    return std::nullopt;
 
-        std::swap( cmds, result );
-      }
+  return recolor;
+}
 
-      BitAssembler pack( int bpp ) const
+// Frames are hashed in parallel. A frame is drawn by the first unique frame whose hash equals the hash of the frame or of one of its mirror images, once they compare equal
+std::vector<FrameRef> findUniqueFrames( Image const& image, std::vector<Bounds> const& frames )
+{
+  std::vector<std::array<uint64_t, 4>> hashes( frames.size() );
+  {
+    TaskGroup group;
+    for ( size_t i = 0; i < frames.size(); ++i )
+    {
+      group.run( [&, i]
       {
-        BitAssembler result;
+        hashes[i] = frameHashes( image, frames[i] );
+      } );
+    }
+    group.wait();
+  }
 
-        for ( Cmd cmd : cmds )
-        {
-          result.shift( 1, cmd.rle ? 0 : 1 );                   // 0 marks that the next data will be RLE, 1 marks that the next data will be LITERAL
-          result.shift( 4, cmd.size - 1 );                      // The next 4 bits will be the number of pixels to draw-1 ... we will call this N
-          if ( cmd.rle )                                        // If the block is RLE
-          {
-            result.shift( bpp, pens[cmd.off] );                 // the next N * (1/2/3/4) bits (depending on bitdepth) will be used for the color of the next N pixels 
-          }
-          else                                                  // If the block is LITERAL
-          {
-            for ( auto it = pens.cbegin() + cmd.off; it != pens.cbegin() + cmd.off + cmd.size; ++it )
-            {
-              result.shift( bpp, *it );                         // the next N * (1/2/3/4) bits (depending on bitdepth) will be used for the color of the next N pixels 
-            }
-          }
-        }
+  std::vector<FrameRef> refs;
+  std::vector<size_t> unique;
 
-        result.flushRow();
-        return result;
+  for ( size_t i = 0; i < frames.size(); ++i )
+  {
+    std::optional<FrameRef> ref;
+    for ( int flip = 0; !ref && flip < 4; ++flip )
+    {
+      for ( size_t u = 0; !ref && u < unique.size(); ++u )
+      {
+        if ( hashes[i][flip] == hashes[unique[u]][0] && sameFrames( image, frames[i], frames[unique[u]], flip ) )
+          ref = FrameRef{ ( int )u, ( flip & 2 ) != 0, ( flip & 1 ) != 0 };
       }
-    } tempBuffer{ row.size() };
+    }
+
+    if ( ref )
+    {
+      LOG << "Frame " << i << " is frame " << unique[ref->unique] << ( ref->hflip ? " flipped horizontally" : "" ) << ( ref->hflip && ref->vflip ? " and" : "" ) << ( ref->vflip ? " flipped vertically" : "" );
+    }
+    else
+    {
+      ref = FrameRef{ ( int )unique.size(), false, false };
+      unique.push_back( i );
+    }
+
+    refs.push_back( *ref );
+  }
+
+  LOG << unique.size() << " of " << frames.size() << " frames are unique";
+
+  return refs;
+}
+
+// Suzy mirrors a sprite around its action point, the first pixel of the sprite data is drawn there either way.
+// A flipped frame is drawn from its opposite edge, so it covers the pixels of the frame
+OutputFile frameTable( std::vector<FrameRef> const& refs, std::vector<Bounds> const& frames, std::filesystem::path output, bool text )
+{
+  output.replace_extension( ".frm" );
+
+  std::vector<uint8_t> table;
+  std::vector<int> offsets;
+  for ( size_t i = 0; i < refs.size(); ++i )
+  {
+    FrameRef const& ref = refs[i];
+    if ( ref.unique > 255 )
+      throw Ex{} << "Frame table can't refer to more than 256 unique frames.\n";
+
+    table.push_back( ( uint8_t )ref.unique );
+    table.push_back( ( ref.hflip ? HFLIP : 0 ) | ( ref.vflip ? VFLIP : 0 ) );
+    offsets.push_back( ref.hflip ? frames[i].maxx - frames[i].minx : 0 );
+    offsets.push_back( ref.vflip ? frames[i].maxy - frames[i].miny : 0 );
+  }
 
-    std::vector<uint8_t> pens;
-    bool rle{};
+  LOG << "Frame table written to " << output;
 
-    for ( auto c : row )
+  if ( !text )
+  {
+    for ( int offset : offsets )
     {
-      int pen = mapper( c );
-      tempBuffer.pens.push_back( ( uint8_t )pen );
+      table.push_back( ( uint8_t )offset );
+      table.push_back( ( uint8_t )( offset >> 8 ) );
     }
+    return OutputFile{ std::move( output ), std::move( table ), false };
+  }
+
+  std::stringstream fout;
+
+  fout << "frames:\t.byte ";
+  bool first = true;
+
+  for ( auto const& value : table )
+  {
+    if ( first )
+      first = false;
+    else
+      fout << ',';
+    fout << " $" << std::hex << std::setfill( '0' ) << std::setw( 2 ) << ( int )value;
+  }
 
-    tempBuffer.tokenize();
-    tempBuffer.optimize();
+  fout << '\n';
 
-    return SpriteRow{ tempBuffer.pack( bpp ) };
+  fout << "offsets:\t.word ";
+  bool firstOffset = true;
+
+  for ( auto const& offset : offsets )
+  {
+    if ( firstOffset )
+      firstOffset = false;
+    else
+      fout << ',';
+    fout << " $" << std::hex << std::setfill( '0' ) << std::setw( 4 ) << offset;
   }
 
-  static SpriteRow literal( int bpp, ImageRow const& row, std::function<int( Color )> mapper )
+  fout << '\n';
+
+  std::string const str = fout.str();
+  return OutputFile{ std::move( output ), std::vector<uint8_t>( str.begin(), str.end() ), true };
+}
+
+// Frames are compared with their previous frames in parallel. Pixels that turn transparent can't be drawn over the previous frame by a sprite that is not a background,
+// so a frame with such pixels is a keyframe
+std::vector<DeltaFrame> findDeltaFrames( Image const& image, std::vector<Bounds> const& frames, int keyInterval, bool background )
+{
+  std::vector<DeltaFrame> result( frames.size() );
+  TaskGroup group;
+
+  for ( size_t i = 0; i < frames.size(); ++i )
   {
-    BitAssembler result;
+    result[i] = DeltaFrame{ frames[i], true };
+    if ( i == 0 || ( keyInterval > 0 && i % keyInterval == 0 ) )
+      continue;
 
-    for ( auto c : row )
+    group.run( [&, i]
     {
-      int pen = mapper( c );
-      result.shift( bpp, pen );
-    }
+      Bounds const& frame = frames[i];
+      Bounds const& previous = frames[i - 1];
+      int const width = frame.maxx - frame.minx + 1;
+      int const height = frame.maxy - frame.miny + 1;
+      Bounds changed{ width, height, -1, -1 };
+
+      for ( int y = 0; y < height; ++y )
+      {
+        for ( int x = 0; x < width; ++x )
+        {
+          Color const c = image( frame.minx + x, frame.miny + y );
+          Color const p = image( previous.minx + x, previous.miny + y );
+          if ( c.key() == p.key() )
+            continue;
 
-    return SpriteRow{ result };
+          if ( !background && c.key() == 0 )
+            return;
+
+          changed = Bounds{ std::min( changed.minx, x ), std::min( changed.miny, y ), std::max( changed.maxx, x ), std::max( changed.maxy, y ) };
+        }
+      }
+
+      // an unchanged frame draws its first pixel again, so every frame has a sprite
+      if ( changed.maxx < 0 )
+        changed = Bounds{ 0, 0, 0, 0 };
+
+      result[i] = DeltaFrame{ Bounds{ frame.minx + changed.minx, frame.miny + changed.miny, frame.minx + changed.maxx, frame.miny + changed.maxy }, false };
+    } );
   }
+  group.wait();
 
-  std::vector<uint8_t>::const_iterator begin() const
+  for ( size_t i = 0; i < frames.size(); ++i )
   {
-    return bitAssembler.getData().cbegin();
+    Bounds const& bounds = result[i].bounds;
+    if ( result[i].key )
+      LOG << "Frame " << i << " is a keyframe";
+    else
+      LOG << "Frame " << i << " changes " << bounds.maxx - bounds.minx + 1 << "x" << bounds.maxy - bounds.miny + 1 << " pixels at " << bounds.minx - frames[i].minx << "," << bounds.miny - frames[i].miny;
   }
 
-  std::vector<uint8_t>::const_iterator end() const
+  return result;
+}
+
+OutputFile deltaTable( std::vector<DeltaFrame> const& deltas, std::vector<Bounds> const& frames, std::filesystem::path output, bool text )
+{
+  output.replace_extension( ".dlt" );
+
+  std::vector<uint8_t> keys;
+  std::vector<int> offsets;
+  for ( size_t i = 0; i < deltas.size(); ++i )
   {
-    return bitAssembler.getData().cend();
+    keys.push_back( deltas[i].key ? 1 : 0 );
+    offsets.push_back( deltas[i].bounds.minx - frames[i].minx );
+    offsets.push_back( deltas[i].bounds.miny - frames[i].miny );
   }
 
-  int size() const
+  LOG << "Delta table written to " << output;
+
+  if ( !text )
   {
-    return ( int )bitAssembler.getData().size();
+    std::vector<uint8_t> table = keys;
+    for ( int offset : offsets )
+    {
+      table.push_back( ( uint8_t )offset );
+      table.push_back( ( uint8_t )( offset >> 8 ) );
+    }
+    return OutputFile{ std::move( output ), std::move( table ), false };
+  }
+
+  std::stringstream fout;
+
+  fout << "keys:\t.byte ";
+  bool firstKey = true;
+
+  for ( auto const& key : keys )
+  {
+    if ( firstKey )
+      firstKey = false;
+    else
+      fout << ',';
+    fout << " $" << std::hex << std::setfill( '0' ) << std::setw( 2 ) << ( int )key;
   }
-};
 
+  fout << '\n';
+
+  fout << "offsets:\t.word ";
+  bool firstOffset = true;
+
+  for ( auto const& offset : offsets )
+  {
+    if ( firstOffset )
+      firstOffset = false;
+    else
+      fout << ',';
+    fout << " $" << std::hex << std::setfill( '0' ) << std::setw( 4 ) << offset;
+  }
+
+  fout << '\n';
+
+  std::string const str = fout.str();
+  return OutputFile{ std::move( output ), std::vector<uint8_t>( str.begin(), str.end() ), true };
 }
 
-void createSprite( Image const& image, Bounds const& bounds, Palette const& pal, std::filesystem::path outputSprite, std::optional<std::filesystem::path> outputImage, std::optional<int> forcedBPP,
-  bool background, bool literal, bool verbose, bool separateFiles )
+FrameColors mergeFrames( std::vector<FrameColors> const& frames )
+{
+  FrameColors result;
+  for ( FrameColors const& frame : frames )
+  {
+    frame.each( [&]( Color c, uint32_t count )
+    {
+      result.findOrInsert( c, []( Color )
+      {
+        return 0u;
+      } ) += count;
+    } );
+  }
+
+  return result;
+}
+
+FrameEncoder::FrameEncoder( Bounds const& bounds, FrameColors const& frameColors, Palette const& pal, std::optional<int> forcedBPP, bool background, bool literal, bool verbose, bool keepPens ) :
+  mBounds{ bounds }, mPalette{ pal }, mColorMapping{}, mIndexPens{}, mColorsUsed{}, mBpp{}, mBackground{ background }, mLiteral{ literal }, mVerbose{ verbose }, mKeepPens{ keepPens }, mPens{}, mRows{}, mBandRows{}, mBandsRunning{}, mParts{}, mGroup{}
 {
   LOG << "\nProcessing frame " << bounds.minx << "," << bounds.miny << " to " << bounds.maxx << "," << bounds.maxy;
 
@@ -354,147 +612,217 @@ void createSprite( Image const& image, Bounds const& bounds, Palette const& pal,
 
   assert( originalColors.size() > 0 );
 
-  struct ColorMapping
-  {
-    Color c;
-    size_t idx;
-    Color mapped;
-  };
-
-  std::vector<ColorMapping> colorMapping;
+  // source color to pen, which is the index of the color in the palette until colors not used by the frame are removed
+  mColorMapping.reserve( frameColors.size() );
+  std::vector<bool> paletteUsed( originalColors.size(), false );
 
-  image.eachPixel( [&]( Color c )
+  frameColors.each( [&]( Color c, uint32_t )
   {
-    auto it = std::find_if( colorMapping.cbegin(), colorMapping.cend(), [&]( ColorMapping const& cm )
+    size_t mappedIdx = pal.mapNearest( c );
+    paletteUsed[mappedIdx] = true;
+    mColorMapping.findOrInsert( c, [&]( Color )
     {
-      return cm.c == c;
+      return ( uint8_t )mappedIdx;
     } );
-    if ( it == colorMapping.cend() )
-    {
-      size_t mappedIdx = pal.mapNearest( c );
-      ColorMapping cm{ c, mappedIdx, originalColors[mappedIdx] };
-      colorMapping.push_back( cm );
-    }
   } );
 
-  auto colorsUsed = originalColors;
+  std::vector<Color> mappedColors;
+  for ( size_t i = 0; i < originalColors.size(); ++i )
+  {
+    if ( paletteUsed[i] )
+      mappedColors.push_back( originalColors[i] );
+  }
+
+  mColorsUsed = originalColors;
 
-  if ( colorMapping.size() < colorsUsed.size() )
+  mColorsUsed.erase( std::remove_if( mColorsUsed.begin() + ( background ? 0 : 1 ), mColorsUsed.end(), [&]( Color c )
   {
-    colorsUsed.erase( std::remove_if( colorsUsed.begin() + ( background ? 0 : 1 ), colorsUsed.end(), [&]( Color c )
-    {
-      auto it = std::find_if( colorMapping.cbegin(), colorMapping.cend(), [&]( ColorMapping const& cm )
-      {
-        return cm.mapped == c;
-      } );
-      return it == colorMapping.cend();
-    } ), colorsUsed.end() );
+    return std::find( mappedColors.cbegin(), mappedColors.cend(), c ) == mappedColors.cend();
+  } ), mColorsUsed.end() );
 
-    for ( auto& cm : colorMapping )
+  if ( mColorsUsed.size() < originalColors.size() )
+  {
+    std::vector<uint8_t> pens( originalColors.size(), 0 );
+    for ( size_t i = 0; i < originalColors.size(); ++i )
     {
-      auto it = std::find( colorsUsed.cbegin(), colorsUsed.cend(), cm.mapped );
-      assert( it != colorsUsed.cend() );
-      cm.idx = std::distance( colorsUsed.cbegin(), it );
+      if ( paletteUsed[i] )
+      {
+        auto it = std::find( mColorsUsed.cbegin(), mColorsUsed.cend(), originalColors[i] );
+        assert( it != mColorsUsed.cend() );
+        pens[i] = ( uint8_t )std::distance( mColorsUsed.cbegin(), it );
+      }
     }
-  }
 
-  auto mapper = [&]( Color c )
-  {
-    for ( auto const& cm : colorMapping )
+    mColorMapping.eachValue( [&]( uint8_t& pen )
     {
-      if ( cm.c == c )
-        return (int)cm.idx;
-    }
-    assert( false );
-    return 0;
-  };
+      pen = pens[pen];
+    } );
+  }
 
-  int colors = (int)colorsUsed.size();
+  int colors = (int)mColorsUsed.size();
 
   LOG << "Frame uses " << colors << " colors";
 
   int paletteSize = std::max( 2, colors );
-  int bpp;
-  for ( bpp = 0; ( 1 << bpp ) < paletteSize; ++bpp );
+  for ( mBpp = 0; ( 1 << mBpp ) < paletteSize; ++mBpp );
 
   if ( forcedBPP )
   {
-    if ( forcedBPP.value() < bpp )
+    if ( forcedBPP.value() < mBpp )
     {
-      throw Ex{} << "Forced bitdepth is too low. Sprite requires " << bpp << " as there is " << colors << " colors";
+      throw Ex{} << "Forced bitdepth is too low. Sprite requires " << mBpp << " as there is " << colors << " colors";
     }
     else
     {
-      LOG << "Sprites requires " << bpp << " bits per pixel, but forced bitdepth is " << forcedBPP.value() << ". This will result in wasted space in the sprite data.";
+      LOG << "Sprites requires " << mBpp << " bits per pixel, but forced bitdepth is " << forcedBPP.value() << ". This will result in wasted space in the sprite data.";
     }
 
-    bpp = forcedBPP.value();
+    mBpp = forcedBPP.value();
   }
 
-  LOG << "Creating " << ( literal ?  "literal" : "packed" ) << " sprite with " << bpp << " bits per pixel";
+  LOG << "Creating " << ( literal ?  "literal" : "packed" ) << " sprite with " << mBpp << " bits per pixel";
 
-  std::vector<SpriteRow> literalRows;
-  std::vector<SpriteRow> packedRows;
-  std::vector<uint8_t> literalData;
-  std::vector<uint8_t> packedData;
+  int const width = bounds.maxx - bounds.minx + 1;
+  mPens.reserve( ( size_t )width * ( keepPens ? bounds.maxy - bounds.miny + 1 : ROWS_PER_TASK ) );
+}
 
-  if ( literal || verbose )
+void FrameEncoder::addRow( int y, std::span<Color const> row )
+{
+  if ( y < mBounds.miny || y > mBounds.maxy )
+    return;
+
+  assert( y == mBounds.miny + mRows );
+
+  std::span<Color const> src = row.subspan( mBounds.minx, mBounds.maxx - mBounds.minx + 1 );
+  std::span<uint8_t> dst = nextRow();
+  uint32_t lastKey = ~0u;
+  uint8_t pen{};
+
+  for ( size_t x = 0; x < src.size(); ++x )
   {
-    for ( int y = bounds.miny; y <= bounds.maxy; ++y )
+    if ( src[x].key() != lastKey )
     {
-      literalRows.push_back( SpriteRow::literal( bpp, image.row( y, bounds.minx, bounds.maxx + 1 ), mapper ) );
+      uint8_t const* mapped = mColorMapping.find( src[x] );
+      assert( mapped );
+      pen = *mapped;
+      lastKey = src[x].key();
     }
+    dst[x] = pen;
+  }
 
-    for ( auto const& row : literalRows )
-    {
-      literalData.push_back( ( uint8_t )row.size() + 1 );
-      for ( uint8_t b : row )
-      {
-        literalData.push_back( b );
-      }
-    }
+  mRows += 1;
+  mBandRows += 1;
+  if ( mBandRows == ROWS_PER_TASK )
+    packBand();
+}
 
-    literalData.push_back( 0 );
-  }
+// Colors of the frame are mapped to pens once per palette index, so every pixel is a single table lookup
+void FrameEncoder::addRow( int y, std::span<uint8_t const> indices, std::vector<Color> const& palette )
+{
+  if ( y < mBounds.miny || y > mBounds.maxy )
+    return;
 
-  if ( !literal || verbose )
+  assert( y == mBounds.miny + mRows && palette.size() == 256 );
+
+  if ( mIndexPens.empty() )
   {
-    for ( int y = bounds.miny; y <= bounds.maxy; ++y )
+    mIndexPens.resize( palette.size() );
+    for ( size_t i = 0; i < palette.size(); ++i )
     {
-      packedRows.push_back( SpriteRow::packed( bpp, image.row( y, bounds.minx, bounds.maxx + 1 ), mapper ) );
+      // indices not used by the frame are not in the mapping
+      uint8_t const* mapped = mColorMapping.find( palette[i] );
+      mIndexPens[i] = mapped ? *mapped : 0;
     }
+  }
 
-    for ( auto const& row : packedRows )
-    {
-      packedData.push_back( ( uint8_t )row.size() + 1 );
-      for ( uint8_t b : row )
-      {
-        packedData.push_back( b );
-      }
-    }
+  std::span<uint8_t const> src = indices.subspan( mBounds.minx, mBounds.maxx - mBounds.minx + 1 );
+  std::span<uint8_t> dst = nextRow();
 
-    packedData.push_back( 0 );
+  for ( size_t x = 0; x < src.size(); ++x )
+  {
+    dst[x] = mIndexPens[src[x]];
   }
 
-  std::vector<int> mapping{};
-  mapping.reserve( 16 );
+  mRows += 1;
+  mBandRows += 1;
+  if ( mBandRows == ROWS_PER_TASK )
+    packBand();
+}
 
-  for ( auto color : colorsUsed )
+std::span<uint8_t> FrameEncoder::nextRow()
+{
+  size_t const width = mBounds.maxx - mBounds.minx + 1;
+  size_t const offset = mPens.size();
+  mPens.resize( offset + width );
+  return { mPens.data() + offset, width };
+}
+
+// Rows are packed independently, so bands of rows are packed by parallel tasks and joined in order.
+// Rows arriving faster than they are packed wait for the running bands, which bounds the pens held
+void FrameEncoder::packBand()
+{
+  if ( mBandRows == 0 )
+    return;
+
+  int const width = mBounds.maxx - mBounds.minx + 1;
+  auto band = std::make_shared<PenPlane>( PenPlane{ width, mBandRows, {} } );
+  if ( mKeepPens )
   {
-    auto it = std::find( originalColors.cbegin(), originalColors.cend(), color );
-    if ( it == originalColors.cend() )
-    {
-      throw Ex{} << "Palette processing error";
-    }
-    mapping.push_back( ( int )std::distance( originalColors.cbegin(), it ) );
+    band->pens.assign( mPens.end() - ( size_t )width * mBandRows, mPens.end() );
   }
+  else
+  {
+    band->pens.swap( mPens );
+    mPens.reserve( band->pens.size() );
+  }
+  mBandRows = 0;
 
-  std::vector<uint8_t> penMapping = std::vector<uint8_t>( ( mapping.size() + 1 ) / 2, 0 );
+  if ( mBandsRunning >= 2 * ThreadPool::instance().threads() )
+  {
+    mGroup.wait();
+    mBandsRunning = 0;
+  }
 
-  for ( int i = 0; i < ( int )mapping.size(); ++i )
+  Part& part = mParts.emplace_back();
+  mBandsRunning += 1;
+  mGroup.run( [this, band, &part]
   {
-    penMapping[i / 2] |= mapping[i] << ( ( i % 2 == 0 ) ? 4 : 0 );
+    encodeRows( mBpp, *band, 0, band->height, mLiteral, mVerbose, part.literalData, part.packedData );
+  } );
+}
+
+std::vector<OutputFile> FrameEncoder::finish( std::filesystem::path outputSprite, std::optional<std::filesystem::path> outputImage, bool separateFiles, bool penTable )
+{
+  assert( mRows == mBounds.maxy - mBounds.miny + 1 && ( mKeepPens || !outputImage ) );
+
+  packBand();
+  mGroup.wait();
+
+  bool const literal = mLiteral;
+  bool const verbose = mVerbose;
+  int const bpp = mBpp;
+  std::vector<Color> const& originalColors = mPalette.colors();
+  std::vector<Color> const& colorsUsed = mColorsUsed;
+  PenPlane const plane{ mBounds.maxx - mBounds.minx + 1, mRows, std::move( mPens ) };
+
+  std::vector<uint8_t> literalData;
+  std::vector<uint8_t> packedData;
+
+  for ( Part const& part : mParts )
+  {
+    literalData.insert( literalData.end(), part.literalData.begin(), part.literalData.end() );
+    packedData.insert( packedData.end(), part.packedData.begin(), part.packedData.end() );
   }
+  mParts.clear();
+
+  if ( literal || verbose )
+    literalData.push_back( 0 );
+  if ( !literal || verbose )
+    packedData.push_back( 0 );
+
+  std::vector<uint8_t> const penMapping = ::penMapping( paletteIndices( colorsUsed, originalColors ) );
+
+  std::vector<OutputFile> files;
 
   if ( outputImage )
   {
@@ -518,25 +846,7 @@ void createSprite( Image const& image, Bounds const& bounds, Palette const& pal,
     state.info_png.color.bitdepth = 8;
     state.info_png.color.palettesize = 1ull << bpp;
 
-    std::vector<uint8_t> indices;
-
-    for ( int y = bounds.miny; y <= bounds.maxy; ++y )
-    {
-      for ( int x = bounds.minx; x <= bounds.maxx; ++x )
-      {
-        Color c = image( x, y );
-        for ( auto const& cm : colorMapping )
-        {
-          if ( cm.c == c )
-          {
-            indices.push_back( uint8_t( cm.idx ) );
-            break;
-          }
-        }
-      }
-    }
-
-    lodepng_encode( &out, &outsize, indices.data(), ( uint32_t )( bounds.maxx - bounds.minx + 1 ), ( uint32_t )( bounds.maxy - bounds.miny + 1 ), &state );
+    lodepng_encode( &out, &outsize, plane.pens.data(), ( uint32_t )plane.width, ( uint32_t )plane.height, &state );
     error = state.error;
     state.info_raw.palette = nullptr;
     lodepng_state_cleanup( &state );
@@ -552,90 +862,87 @@ void createSprite( Image const& image, Bounds const& bounds, Palette const& pal,
       throw Ex{} << "PNG encode error " << error << ": " << lodepng_error_text( error );
     }
 
-    std::ofstream fout{ *outputImage, std::ios::binary };
-    fout.write( ( char* )data.get(), outsize );
+    files.push_back( OutputFile{ *outputImage, std::vector<uint8_t>( data.get(), data.get() + outsize ), false } );
 
     LOG << "Output image written to " << *outputImage;
   }
 
   {
-    std::ofstream fout{ outputSprite, std::ios::binary };
+    std::vector<uint8_t> sprite;
 
     LOG << "Writing output to " << outputSprite;
 
-    auto off = fout.tellp();
+    if ( penTable && !separateFiles )
+      appendPalette( sprite, penMapping, originalColors );
 
-    if ( !separateFiles )
-    {
-      fout.write( ( char* )penMapping.data(), penMapping.size() );
-      LOG << fout.tellp() - off << " bytes of pen mapping data written at offset " << off;
-
-      off = fout.tellp();
-
-      for ( auto const& color : originalColors )
-      {
-        fout.put( color.g4() );
-      }
-      LOG << fout.tellp() - off << " bytes of green palette data written at offset " << off;
-
-      off = fout.tellp();
-
-      for ( auto const& color : originalColors )
-      {
-        fout.put( color.br4() );
-      }
-      LOG << fout.tellp() - off << " bytes of blue and red palette data written at offset " << off;
-    }
-
-    off = fout.tellp();
+    size_t const off = sprite.size();
 
     if ( literal )
     {
-      fout.write( ( char* )literalData.data(), literalData.size() );
+      sprite.insert( sprite.end(), literalData.begin(), literalData.end() );
       LOG << literalData.size() << " bytes of sprite data written to at offset " << off << ". Packed sprite would have " << packedData.size() << " bytes";
     }
     else
     {
-      fout.write( ( char* )packedData.data(), packedData.size() );
+      sprite.insert( sprite.end(), packedData.begin(), packedData.end() );
       LOG << packedData.size() << " bytes of sprite data written to at offset " << off << ". Literal sprite would have " << literalData.size() << " bytes";
     }
+
+    files.push_back( OutputFile{ outputSprite, std::move( sprite ), false } );
   }
 
-  if ( separateFiles )
-  {
-    outputSprite.replace_extension( ".pal" );
-    std::ofstream fout{ outputSprite };
+  if ( penTable && separateFiles )
+    files.push_back( paletteText( outputSprite, penMapping, originalColors ) );
 
-    fout << "redir:\t.byte ";
-    bool firstRedir = true;
+  return files;
+}
 
-    for ( auto const& pen : penMapping )
-    {
-      if ( firstRedir )
-        firstRedir = false;
-      else
-        fout << ',';
-      fout << " $" << std::hex << std::setfill( '0' ) << std::setw( 2 ) << ( int )pen;
-    }
+std::vector<OutputFile> FrameEncoder::paletteFiles( std::filesystem::path output, bool separateFiles ) const
+{
+  std::vector<Color> const& originalColors = mPalette.colors();
+  return ::paletteFiles( penMapping( paletteIndices( mColorsUsed, originalColors ) ), originalColors, std::move( output ), separateFiles );
+}
 
-    fout << '\n';
+// Every pen takes the palette index of the variant colors of its source colors. Pens without source colors in the frame keep their index
+std::optional<std::vector<OutputFile>> FrameEncoder::variantFiles( ColorMap<Color> const& recolor, std::filesystem::path output, bool separateFiles ) const
+{
+  std::vector<Color> const& originalColors = mPalette.colors();
+  std::vector<int> mapping = paletteIndices( mColorsUsed, originalColors );
+  std::vector<bool> mapped( mapping.size(), false );
+  bool drawn = true;
 
-    fout << "pal:\t.word ";
-    bool firstPal = true;
+  mColorMapping.each( [&]( Color c, uint8_t pen )
+  {
+    Color const* variant = recolor.find( c );
+    assert( variant );
+    int const index = ( int )mPalette.mapNearest( *variant );
 
-    for ( auto const& color : originalColors )
-    {
-      if ( firstPal )
-        firstPal = false;
-      else
-        fout << ',';
-      fout << " $" << color.str();
-    }
+    // pen 0 of a sprite that is not a background is transparent whatever palette index it maps to
+    if ( ( mapped[pen] && mapping[pen] != index ) || ( !mBackground && ( pen == 0 ) != ( index == 0 ) ) )
+      drawn = false;
 
-    fout << '\n';
+    mapping[pen] = index;
+    mapped[pen] = true;
+  } );
 
-    LOG << "Palette data written to " << outputSprite;
-  }
+  if ( !drawn )
+    return std::nullopt;
 
+  return ::paletteFiles( penMapping( mapping ), originalColors, std::move( output ), separateFiles );
 }
 
+std::vector<OutputFile> createSprite( Image const& image, Bounds const& bounds, FrameColors const& frameColors, Palette const& pal, std::filesystem::path outputSprite, std::optional<std::filesystem::path> outputImage, std::optional<int> forcedBPP,
+  bool background, bool literal, bool verbose, bool separateFiles )
+{
+  FrameEncoder encoder{ bounds, frameColors, pal, forcedBPP, background, literal, verbose, outputImage.has_value() };
+
+  for ( int y = bounds.miny; y <= bounds.maxy; ++y )
+  {
+    if ( image.indexed() )
+      encoder.addRow( y, image.indices( y, 0, image.width() ), image.palette() );
+    else
+      encoder.addRow( y, image.pixels( y, 0, image.width() ) );
+  }
+
+  return encoder.finish( std::move( outputSprite ), std::move( outputImage ), separateFiles, true );
+}
@@ -2,6 +2,9 @@
 
 #include "Image.hpp"
 #include "Palette.hpp"
+#include "ColorMap.hpp"
+#include "ThreadPool.hpp"
+#include <deque>
 
 struct Bounds
 {
@@ -11,5 +14,112 @@ struct Bounds
   int maxy;
 };
 
-void createSprite( Image const& image, Bounds const& bounds, Palette const& pal, std::filesystem::path outputSprite, std::optional<std::filesystem::path> outputImage, std::optional<int> forcedBPP,
+// pixel count of every color of a frame
+using FrameColors = ColorMap<uint32_t>;
+
+// counts colors of all frames in a single pass over the image
+std::vector<FrameColors> analyzeFrames( Image const& image, std::vector<Bounds> const& frames );
+
+// colors of variant replacing every color of image one to one, nothing if variant differs from image in more than its colors
+std::optional<ColorMap<Color>> recolorOf( Image const& image, Image const& variant );
+
+// unique frame drawing a frame and whether it is drawn mirrored
+struct FrameRef
+{
+  // index among the unique frames in the order they appear
+  int unique;
+  bool hflip;
+  bool vflip;
+};
+
+// unique frame drawing every frame, frames equal to an earlier frame or to its mirror images are drawn by it. The image must not be streamed
+std::vector<FrameRef> findUniqueFrames( Image const& image, std::vector<Bounds> const& frames );
+
+// rectangle of a frame packed as its sprite, a keyframe is drawn whole and other frames are drawn over their previous frame
+struct DeltaFrame
+{
+  Bounds bounds;
+  bool key;
+};
+
+// rectangle of every frame that changed since its previous frame. The first frame and every keyInterval-th frame are keyframes, only the first if keyInterval is 0.
+// The image must not be streamed
+std::vector<DeltaFrame> findDeltaFrames( Image const& image, std::vector<Bounds> const& frames, int keyInterval, bool background );
+
+// colors of all frames together, frames encoded with them get the same pens and bits per pixel
+FrameColors mergeFrames( std::vector<FrameColors> const& frames );
+
+// contents of a file to be written by a later pipeline stage, text files translate line ends like std::ofstream in text mode
+struct OutputFile
+{
+  std::filesystem::path path;
+  std::vector<uint8_t> data;
+  bool text;
+};
+
+// table of the unique frame and the SPRCTL0 HFLIP and VFLIP bits of every frame, two bytes per frame, followed by the x and y offset words
+// moving the position of every frame to where its flipped sprite is drawn, or as assembler source with text
+OutputFile frameTable( std::vector<FrameRef> const& refs, std::vector<Bounds> const& frames, std::filesystem::path output, bool text );
+
+// table of a keyframe byte of every frame followed by the x and y offset words of every frame sprite in the frame, or as assembler source with text
+OutputFile deltaTable( std::vector<DeltaFrame> const& deltas, std::vector<Bounds> const& frames, std::filesystem::path output, bool text );
+
+// Packs one frame from rows of the image given from the top. Rows are mapped to pens as they arrive and packed in bands by parallel tasks,
+// so pens of the whole frame are held only when the frame is written as an image too
+class FrameEncoder
+{
+public:
+  // keepPens keeps pens of all rows for the output image
+  FrameEncoder( Bounds const& bounds, FrameColors const& frameColors, Palette const& pal, std::optional<int> forcedBPP, bool background, bool literal, bool verbose, bool keepPens );
+  FrameEncoder( FrameEncoder const& ) = delete;
+  FrameEncoder& operator=( FrameEncoder const& ) = delete;
+
+  // row y of the image, rows outside of the frame are skipped
+  void addRow( int y, std::span<Color const> row );
+  // row y of an indexed image given by palette indices
+  void addRow( int y, std::span<uint8_t const> indices, std::vector<Color> const& palette );
+
+  // returns the files of the sprite in the order they should be written, once all rows of the frame are added.
+  // Without penTable only sprite data is written, the pen mapping shared by frames is written once by paletteFiles
+  std::vector<OutputFile> finish( std::filesystem::path outputSprite, std::optional<std::filesystem::path> outputImage, bool separateFiles, bool penTable );
+
+  // pen mapping and palette of the frame alone, as binary data or with separateFiles as assembler source with .pal extension
+  std::vector<OutputFile> paletteFiles( std::filesystem::path output, bool separateFiles ) const;
+  // pen mapping drawing the frame in the colors of a variant recolored from the image and the palette like paletteFiles,
+  // nothing if colors sharing a pen get different palette colors in the variant
+  std::optional<std::vector<OutputFile>> variantFiles( ColorMap<Color> const& recolor, std::filesystem::path output, bool separateFiles ) const;
+
+private:
+  struct Part
+  {
+    std::vector<uint8_t> literalData;
+    std::vector<uint8_t> packedData;
+  };
+
+  // appends pens of a row of the frame
+  std::span<uint8_t> nextRow();
+  void packBand();
+
+  Bounds const mBounds;
+  Palette const& mPalette;
+  ColorMap<uint8_t> mColorMapping;
+  // pens of palette indices of an indexed image, filled by its first row
+  std::vector<uint8_t> mIndexPens;
+  std::vector<Color> mColorsUsed;
+  int mBpp;
+  bool const mBackground;
+  bool const mLiteral;
+  bool const mVerbose;
+  bool const mKeepPens;
+  // pens of the rows added so far, only of the band not packed yet unless pens are kept
+  std::vector<uint8_t> mPens;
+  int mRows;
+  int mBandRows;
+  int mBandsRunning;
+  std::deque<Part> mParts;
+  TaskGroup mGroup;
+};
+
+// returns the files of the sprite in the order they should be written
+std::vector<OutputFile> createSprite( Image const& image, Bounds const& bounds, FrameColors const& frameColors, Palette const& pal, std::filesystem::path outputSprite, std::optional<std::filesystem::path> outputImage, std::optional<int> forcedBPP,
   bool background, bool literal, bool verbose, bool separateFiles );
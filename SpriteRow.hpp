@@ -0,0 +1,230 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <span>
+#include <vector>
+
+#if defined( __BMI2__ )
+#include <immintrin.h>
+#endif
+
+// Bit level encoding of sprite rows. Rows are encoded with pens already mapped, one byte per pixel
+
+class BitAssembler
+{
+  std::vector<uint8_t> buffer;
+  uint64_t accum;
+  int size;
+public:
+
+  BitAssembler( size_t capacity = 0 ) : buffer{}, accum{}, size{}
+  {
+    buffer.reserve( capacity );
+  }
+
+  BitAssembler( BitAssembler&& other ) noexcept : buffer{ std::move( other.buffer ) }, accum{ other.accum }, size{ other.size }
+  {
+    other.accum = other.size = 0;
+  }
+
+  ~BitAssembler()
+  {
+    assert( size == 0 );
+  }
+
+  // Bits are collected in a 64-bit accumulator and stored a 32-bit word at a time, so at most 32 bits may be shifted in at once
+  void shift( int bits, uint32_t value )
+  {
+    assert( bits > 0 && bits <= 32 );
+    accum = ( accum << bits ) | value;
+    size += bits;
+    if ( size >= 32 )
+    {
+      size -= 32;
+      uint32_t word = ( uint32_t )( accum >> size );
+      size_t offset = buffer.size();
+      buffer.resize( offset + 4 );
+      buffer[offset + 0] = ( uint8_t )( word >> 24 );
+      buffer[offset + 1] = ( uint8_t )( word >> 16 );
+      buffer[offset + 2] = ( uint8_t )( word >> 8 );
+      buffer[offset + 3] = ( uint8_t )word;
+    }
+  }
+
+  void flushRow( bool literal = false )
+  {
+    for ( ; size >= 8; size -= 8 )
+    {
+      buffer.push_back( ( uint8_t )( accum >> ( size - 8 ) ) );
+    }
+
+    if ( size > 0 )
+    {
+      buffer.push_back( ( uint8_t )( accum << ( 8 - size ) ) );
+      accum = size = 0;
+    }
+    else if ( !literal )
+    {
+      // There is a bug in the hardware that requires that the last meaningful bit of the data packet at the end of a scan line does not occur in the last bit of a byte (bit 0).
+      // This means that the data packet creation process must check for this case, and if found, must pad this data packet with a byte of all 0s.
+      buffer.push_back( 0 );
+    }
+    accum = 0;
+  }
+
+  std::vector<uint8_t> const& getData() const
+  {
+    return buffer;
+  }
+
+  void update( size_t offset, uint8_t value )
+  {
+    assert( offset < buffer.size() );
+    buffer[offset] = value;
+  }
+
+};
+
+// Packs eight pens, one per byte with the first pen in the lowest byte, into 8 * bpp bits with the first pen in the most significant position
+template<int bpp>
+uint32_t packPens( uint8_t const* pens )
+{
+  uint64_t bytes;
+  std::memcpy( &bytes, pens, sizeof( bytes ) );
+#if defined( __BMI2__ )
+  constexpr uint64_t mask = 0x0101010101010101ull * ( ( 1u << bpp ) - 1 );
+  return ( uint32_t )_pext_u64( __builtin_bswap64( bytes ), mask );
+#else
+  uint32_t result = 0;
+  for ( int i = 0; i < 8; ++i )
+  {
+    result = ( result << bpp ) | ( uint32_t )( ( bytes >> ( i * 8 ) ) & 0xff );
+  }
+  return result;
+#endif
+}
+
+
+class SpriteRow
+{
+  explicit SpriteRow() : bitAssembler{}
+  {
+  }
+
+  SpriteRow( BitAssembler bitAssembler ) : bitAssembler{ std::move( bitAssembler ) }
+  {
+  }
+
+  BitAssembler bitAssembler;
+
+public:
+
+  template<int bpp>
+  static SpriteRow packed( std::span<uint8_t const> pens )
+  {
+    struct Cmd
+    {
+      bool rle;
+      int size;
+    };
+
+    int const n = ( int )pens.size();
+
+    // Every packet is 5 bits of header followed by one pen for RLE or by all its pens for LITERAL and covers 1 to 16 pixels.
+    // cost[i] is the minimal number of bits encoding pens from i to the end of the row, choice[i] is the first packet of that encoding.
+    // The row takes bits / 8 + 1 bytes whether or not flushRow needs the padding byte, so the fewest bits give the fewest bytes.
+    // Shortening the first packet never costs more, so cost does not grow along the row and the longest RLE packet is the best RLE choice.
+    std::vector<uint32_t> cost( n + 1, 0 );
+    std::vector<Cmd> choice( n );
+    int run = 0;
+
+    for ( int i = n - 1; i >= 0; --i )
+    {
+      run = ( i + 1 < n && pens[i] == pens[i + 1] ) ? run + 1 : 1;
+
+      // A header of 00000 ends the row on Suzy, so a single pen is a LITERAL packet of the same size instead of an RLE one
+      int size = std::min( 16, run );
+      uint32_t best = 5 + bpp + cost[i + size];
+      Cmd cmd{ size > 1, size };
+
+      for ( size = 2; size <= std::min( 16, n - i ); ++size )
+      {
+        uint32_t score = 5 + size * bpp + cost[i + size];
+        if ( score < best )
+        {
+          best = score;
+          cmd = Cmd{ false, size };
+        }
+      }
+
+      cost[i] = best;
+      choice[i] = cmd;
+    }
+
+    BitAssembler result{ n > 0 ? cost[0] / 8 + 1 : 1 };
+
+    for ( int off = 0; off < n; off += choice[off].size )
+    {
+      Cmd cmd = choice[off];
+      result.shift( 5, ( cmd.rle ? 0 : 0x10 ) | ( cmd.size - 1 ) );  // 0 marks that the next data will be RLE, 1 marks that the next data will be LITERAL
+                                                                   // The next 4 bits will be the number of pixels to draw-1 ... we will call this N
+      if ( cmd.rle )                                               // If the block is RLE
+      {
+        result.shift( bpp, pens[off] );                            // the next N * (1/2/3/4) bits (depending on bitdepth) will be used for the color of the next N pixels 
+      }
+      else                                                         // If the block is LITERAL
+      {
+        int i = off;
+        for ( ; i + 8 <= off + cmd.size; i += 8 )
+        {
+          result.shift( 8 * bpp, packPens<bpp>( &pens[i] ) );      // the next N * (1/2/3/4) bits (depending on bitdepth) will be used for the color of the next N pixels 
+        }
+        for ( ; i < off + cmd.size; ++i )
+        {
+          result.shift( bpp, pens[i] );
+        }
+      }
+    }
+
+    result.flushRow();
+    return SpriteRow{ std::move( result ) };
+  }
+
+  template<int bpp>
+  static SpriteRow literal( std::span<uint8_t const> pens )
+  {
+    size_t const n = pens.size();
+    BitAssembler result{ n * bpp / 8 + 1 };
+
+    size_t i = 0;
+    for ( ; i + 8 <= n; i += 8 )
+    {
+      result.shift( 8 * bpp, packPens<bpp>( &pens[i] ) );
+    }
+    for ( ; i < n; ++i )
+    {
+      result.shift( bpp, pens[i] );
+    }
+
+    result.flushRow( true );
+    return SpriteRow{ std::move( result ) };
+  }
+
+  std::vector<uint8_t>::const_iterator begin() const
+  {
+    return bitAssembler.getData().cbegin();
+  }
+
+  std::vector<uint8_t>::const_iterator end() const
+  {
+    return bitAssembler.getData().cend();
+  }
+
+  int size() const
+  {
+    return ( int )bitAssembler.getData().size();
+  }
+};
@@ -1,71 +1,524 @@
 ﻿
 #include <iostream>
 #include <cstdio>
+#include <fstream>
+#include <map>
+#include <mutex>
 #include "Ex.hpp"
 #include "Palette.hpp"
+#include "Quantizer.hpp"
 #include "Image.hpp"
 #include "Sprite.hpp"
 #include "Log.hpp"
+#include "ThreadPool.hpp"
+#include "Pipeline.hpp"
 
 #include "ProgramOptions.hpp"
 
-int main( int argc, char const* argv[] )
+namespace
 {
-  try
+
+// whether the palette is computed from the input alone
+bool paletteIsInput( ProgramOptions const& options )
+{
+  std::vector<std::filesystem::path> const& palettes = options.palettes();
+  return palettes.size() == 1 && std::filesystem::equivalent( palettes[0], options.input() );
+}
+
+// Palettes reduced so far, keyed by their source and the options they were reduced with.
+// Each palette is reduced once by the first task asking for it, other tasks asking meanwhile wait for it
+class PaletteCache
+{
+public:
+  // input is the decoded input image if there is one, with palette banks it gets the palette of its bank
+  Palette const& get( ProgramOptions const& options, std::optional<Image> const& input )
   {
-    ProgramOptions options{ argc, argv };
+    std::stringstream ss;
+    for ( std::filesystem::path const& palette : options.palettes() )
+    {
+      ss << palette.string() << "|";
+    }
+    ss << options.maxColors() << "|" << options.quantizer() << "|" << options.refineIterations() << "|" << options.lynxHistogram() << "|" << options.lynxColors() << "|" << options.banks()
+      << "|" << ( options.optimalPalette() ? options.optimalPalette()->string() : std::string{} ) << "|" << ( options.nearestCache() ? options.nearestCache()->string() : std::string{} );
 
-    Log::instance().verbose( options.verbose() );
+    Entry* entry;
+    {
+      std::lock_guard<std::mutex> lock{ mMutex };
+      entry = &mEntries[ss.str()];
+    }
 
-    LOG << "Suzy Sprite Packer";
+    bool reduced = false;
+    std::call_once( entry->once, [&]
+    {
+      auto quantizer = Quantizer::create( options.quantizer() );
+
+      if ( options.banks() > 1 )
+      {
+        entry->banks.emplace( options.palettes(), options.banks(), options.maxColors(), *quantizer, options.refineIterations(), options.lynxHistogram(), options.lynxColors(), options.optimalPalette() );
+      }
+      else if ( paletteIsInput( options ) )
+      {
+        std::optional<Image> decoded;
+        Image const& src = input ? *input : decoded.emplace( options.input() );
+        entry->palette.emplace( src, options.palettes()[0], options.maxColors(), *quantizer, options.refineIterations(), options.lynxHistogram(), options.lynxColors(), options.optimalPalette() );
+      }
+      else
+      {
+        entry->palette.emplace( options.palettes(), options.maxColors(), *quantizer, options.refineIterations(), options.lynxHistogram(), options.lynxColors(), options.optimalPalette() );
+      }
+
+      if ( options.nearestCache() )
+      {
+        if ( entry->banks )
+          entry->banks->useNearestTable( *options.nearestCache() );
+        else
+          entry->palette->useNearestTable( *options.nearestCache() );
+      }
 
-    Palette palette{ options.palette(), options.maxColors(), options.optimalPalette() };
+      reduced = true;
+    } );
 
-    if ( options.noSpriteGen() )
-      return 0;
+    if ( !reduced )
+    {
+      if ( options.palettes().size() == 1 )
+        LOG << "Palette " << options.palettes()[0] << " reused";
+      else
+        LOG << "Palette of " << options.palettes().size() << " images reused";
+    }
 
-    Image image{ options.input() };
-    Bounds bounds{ 0, 0, image.width() - 1, image.height() - 1 };
-    LOG << "Image " << options.input() << " dimensions: " << image.width() << "x" << image.height();
+    if ( !entry->banks )
+      return *entry->palette;
 
-    if ( options.frameWidth() )
+    // an input among the palette images has the bank it was grouped into, without a decoded input no sprite is packed and any bank does
+    PaletteBanks const& banks = *entry->banks;
+    std::vector<std::filesystem::path> const& sources = options.palettes();
+    auto source = std::find_if( sources.begin(), sources.end(), [&]( std::filesystem::path const& path )
     {
-      int width = options.frameWidth().value();
-      LOG << "Frame width: " << width;
+      return std::filesystem::equivalent( path, options.input() );
+    } );
 
-      if ( image.width() % width != 0 )
-        throw Ex{} << "Image dimensions are not evenly divisible by frame width.\n";
+    size_t bank = 0;
+    if ( source != sources.end() )
+      bank = banks.bankOf( ( size_t )std::distance( sources.begin(), source ) );
+    else if ( input )
+      bank = banks.bankOf( *input );
 
-      int frames = image.width() / width;
+    LOG << "Sprite uses palette bank " << bank << " of " << banks.size();
+    return banks.palette( bank );
+  }
 
-      LOG << "Number of frames in animation: " << frames;
+  size_t size() const
+  {
+    return mEntries.size();
+  }
+
+private:
+  struct Entry
+  {
+    std::once_flag once;
+    std::optional<Palette> palette;
+    std::optional<PaletteBanks> banks;
+  };
+
+  std::mutex mMutex;
+  std::map<std::string, Entry> mEntries;
+};
+
+// whether pack needs the decoded input
+bool needsInput( ProgramOptions const& options )
+{
+  return !options.noSpriteGen() || paletteIsInput( options );
+}
+
+// output files of one frame
+struct FramePaths
+{
+  std::filesystem::path sprite;
+  std::optional<std::filesystem::path> image;
+};
 
-      bounds.maxx = width - 1;
-      int maxFrameLength = std::snprintf( nullptr, 0, "%d", frames - 1 );
-      for ( int i = 0; i < frames; ++i )
+// Queues the pen mapping and palette of every variant drawn with the sprite data of the encoder, variants are decoded and compared in parallel
+void packVariants( ProgramOptions const& options, Image const& image, FrameEncoder const& encoder, FileWriter& writer, size_t tag )
+{
+  std::vector<std::filesystem::path> const& variants = options.variants();
+  std::vector<std::vector<OutputFile>> files( variants.size() );
+
+  TaskGroup group;
+  for ( size_t i = 0; i < variants.size(); ++i )
+  {
+    group.run( [&, i]
+    {
+      std::filesystem::path output = options.output().parent_path() / variants[i].stem();
+      output += options.output().extension();
+
+      std::optional<ColorMap<Color>> recolor = recolorOf( image, Image{ variants[i] } );
+      std::optional<std::vector<OutputFile>> result = recolor ? encoder.variantFiles( *recolor, output, options.separateOutput() ) : std::nullopt;
+      if ( !result )
+        throw Ex{} << "Variant " << variants[i] << " is not a recolor of " << options.input() << " drawable with its pens.\n";
+
+      files[i] = std::move( *result );
+    } );
+  }
+  group.wait();
+
+  for ( size_t i = 0; i < variants.size(); ++i )
+  {
+    LOG << "Variant " << variants[i] << " shares sprite data of " << options.input();
+    for ( auto& file : files[i] )
+    {
+      writer.write( tag, std::move( file ) );
+    }
+  }
+}
+
+// Packs the decoded input, if needed, and queues the files of every frame to the writer as soon as the frame is packed
+void pack( ProgramOptions const& options, std::optional<Image> const& input, PaletteCache& palettes, FileWriter& writer, size_t tag )
+{
+  Palette const& palette = palettes.get( options, input );
+
+  if ( options.noSpriteGen() )
+    return;
+
+  Image const& image = *input;
+  Bounds bounds{ 0, 0, image.width() - 1, image.height() - 1 };
+  LOG << "Image " << options.input() << " dimensions: " << image.width() << "x" << image.height();
+
+  std::vector<Bounds> frameBounds;
+  std::function<FramePaths( int )> framePaths;
+
+  if ( options.frameWidth() )
+  {
+    int width = options.frameWidth().value();
+    LOG << "Frame width: " << width;
+
+    if ( image.width() % width != 0 )
+      throw Ex{} << "Image dimensions are not evenly divisible by frame width.\n";
+
+    int frames = image.width() / width;
+
+    LOG << "Number of frames in animation: " << frames;
+
+    for ( int i = 0; i < frames; ++i )
+    {
+      frameBounds.push_back( Bounds{ i * width, 0, ( i + 1 ) * width - 1, image.height() - 1 } );
+    }
+
+    int maxFrameLength = std::snprintf( nullptr, 0, "%d", frames - 1 );
+    framePaths = [&options, maxFrameLength]( int i )
+    {
+      FramePaths paths;
       {
-        std::string outputPath;
-        std::string outputImagePath;
+        std::stringstream ss;
+        ss << options.output().replace_extension().string() << "_" << std::setfill( '0' ) << std::setw( maxFrameLength ) << i << options.output().extension().string();
+        paths.sprite = ss.str();
+      }
+      if ( options.outputImage() )
+      {
+        std::stringstream ss;
+        ss << options.outputImage()->replace_extension().string() << "_" << std::setfill( '0' ) << std::setw( maxFrameLength ) << i << options.outputImage()->extension().string();
+        paths.image = ss.str();
+      }
+      return paths;
+    };
+  }
+  else
+  {
+    frameBounds.push_back( bounds );
+    framePaths = [&options]( int )
+    {
+      return FramePaths{ options.output(), options.outputImage() };
+    };
+  }
+
+  if ( options.uniqueFrames() && frameBounds.size() > 1 )
+  {
+    if ( image.streamed() )
+    {
+      LOG << "Frames of a streamed image are not compared, every frame is packed";
+    }
+    else
+    {
+      std::vector<FrameRef> refs = findUniqueFrames( image, frameBounds );
+      writer.write( tag, frameTable( refs, frameBounds, options.output(), options.separateOutput() ) );
+
+      // every unique frame is the first frame it draws
+      std::vector<Bounds> unique;
+      for ( size_t i = 0; i < refs.size(); ++i )
+      {
+        if ( refs[i].unique == ( int )unique.size() )
+          unique.push_back( frameBounds[i] );
+      }
+      frameBounds = std::move( unique );
+    }
+  }
+
+  if ( options.deltaFrames() && frameBounds.size() > 1 )
+  {
+    if ( image.streamed() )
+    {
+      LOG << "Frames of a streamed image are not compared, every frame is packed whole";
+    }
+    else
+    {
+      std::vector<DeltaFrame> deltas = findDeltaFrames( image, frameBounds, *options.deltaFrames(), options.backround() );
+      writer.write( tag, deltaTable( deltas, frameBounds, options.output(), options.separateOutput() ) );
+
+      for ( size_t i = 0; i < deltas.size(); ++i )
+      {
+        frameBounds[i] = deltas[i].bounds;
+      }
+    }
+  }
+
+  auto frameColors = analyzeFrames( image, frameBounds );
+  int const frames = ( int )frameBounds.size();
+  bool const sharedPens = options.sharedPens() && options.frameWidth();
+
+  if ( sharedPens )
+  {
+    // every frame maps the colors of all frames, so all get the same pens and bits per pixel
+    FrameColors colors = mergeFrames( frameColors );
+    frameColors.assign( frames, colors );
+  }
+
+  if ( image.streamed() || sharedPens || !options.variants().empty() )
+  {
+    // rows of a streamed image are decoded once more and given to the encoders of all frames,
+    // frames sharing pens and images with variants are encoded together too, so their pen mappings are written once before them
+    std::vector<std::unique_ptr<FrameEncoder>> encoders;
+    for ( int i = 0; i < frames; ++i )
+    {
+      encoders.push_back( std::make_unique<FrameEncoder>( frameBounds[i], frameColors[i], palette, options.forcedBPP(), options.backround(), options.literal(), options.verbose(), options.outputImage().has_value() ) );
+    }
+
+    if ( sharedPens )
+    {
+      LOG << "\nPen mapping shared by " << frames << " frames";
+      for ( auto& file : encoders[0]->paletteFiles( options.output(), options.separateOutput() ) )
+      {
+        writer.write( tag, std::move( file ) );
+      }
+    }
+
+    if ( !options.variants().empty() )
+      packVariants( options, image, *encoders[0], writer, tag );
+
+    if ( image.indexed() )
+    {
+      image.eachIndexRow( [&]( int y, std::span<uint8_t const> row )
+      {
+        for ( auto& encoder : encoders )
         {
-          std::stringstream ss;
-          ss << options.output().replace_extension().string() << "_" << std::setfill( '0' ) << std::setw( maxFrameLength ) << i << options.output().extension().string();
-          outputPath = ss.str();
+          encoder->addRow( y, row, image.palette() );
         }
-        if ( options.outputImage() )
+      } );
+    }
+    else
+    {
+      image.eachRow( [&]( int y, std::span<Color const> row )
+      {
+        for ( auto& encoder : encoders )
         {
-          std::stringstream ss;
-          ss << options.outputImage()->replace_extension().string() << "_" << std::setfill( '0' ) << std::setw( maxFrameLength ) << i << options.outputImage()->extension().string();
-          outputImagePath = ss.str();
+          encoder->addRow( y, row );
         }
-        createSprite( image, bounds, palette, outputPath, options.outputImage() ? std::optional<std::filesystem::path>{ outputImagePath } : std::optional<std::filesystem::path>{}, options.forcedBPP(), options.backround(), options.literal(), options.verbose(), options.separateOutput()  );
-        bounds.minx += width;
-        bounds.maxx += width;
+      } );
+    }
+
+    for ( int i = 0; i < frames; ++i )
+    {
+      FramePaths paths = framePaths( i );
+      for ( auto& file : encoders[i]->finish( paths.sprite, paths.image, options.separateOutput(), !sharedPens ) )
+      {
+        writer.write( tag, std::move( file ) );
       }
+      encoders[i].reset();
     }
-    else
+  }
+  else
+  {
+    TaskGroup group;
+    for ( int i = 0; i < frames; ++i )
+    {
+      group.run( [&, i]
+      {
+        FramePaths paths = framePaths( i );
+        auto files = createSprite( image, frameBounds[i], frameColors[i], palette, paths.sprite, paths.image, options.forcedBPP(), options.backround(), options.literal(), options.verbose(), options.separateOutput() );
+        for ( auto& file : files )
+        {
+          writer.write( tag, std::move( file ) );
+        }
+      } );
+    }
+    group.wait();
+  }
+}
+
+// Packs every line of the manifest as if it were a command line. Errors are reported per line and do not stop the batch.
+// Lines are packed in parallel, the largest images are started first and decoded images in flight are limited to memoryLimit bytes
+int packManifest( std::filesystem::path const& path, size_t memoryLimit )
+{
+  std::ifstream fin{ path };
+  if ( !fin )
+    throw Ex{} << "Can't open manifest " << path << "\n";
+
+  struct Entry
+  {
+    int line;
+    std::vector<std::string> args;
+    uint64_t cost;
+    std::string error;
+  };
+
+  std::vector<Entry> entries;
+  std::string line;
+  for ( int lineNumber = 1; std::getline( fin, line ); ++lineNumber )
+  {
+    if ( !line.empty() && line.back() == '\r' )
+      line.pop_back();
+
+    std::vector<std::string> args = boost::program_options::split_unix( line );
+    if ( args.empty() || args[0][0] == '#' )
+      continue;
+
+    entries.push_back( Entry{ lineNumber, std::move( args ), 0, {} } );
+  }
+
+  std::vector<std::unique_ptr<ProgramOptions>> options( entries.size() );
+  std::vector<size_t> order;
+  for ( size_t i = 0; i < entries.size(); ++i )
+  {
+    try
+    {
+      options[i] = std::make_unique<ProgramOptions>( entries[i].args );
+      if ( options[i]->manifest() )
+        throw Ex{} << "Manifest entries can't refer to other manifests.\n";
+
+      entries[i].cost = Image::area( options[i]->input() );
+      order.push_back( i );
+    }
+    catch ( std::exception const& e )
+    {
+      entries[i].error = e.what();
+    }
+  }
+
+  std::stable_sort( order.begin(), order.end(), [&]( size_t l, size_t r )
+  {
+    return entries[l].cost > entries[r].cost;
+  } );
+
+  // Decoding runs ahead on its own thread within the memory limit, packing runs on the thread pool and files are written on the writer thread
+  struct Decoded
+  {
+    size_t entry;
+    std::optional<Image> image;
+    size_t bytes;
+  };
+
+  BoundedQueue<Decoded> decoded{ ( size_t )ThreadPool::instance().threads() + 1 };
+  MemoryBudget budget{ memoryLimit };
+
+  std::thread decoder{ [&]
+  {
+    for ( size_t i : order )
     {
-      createSprite( image, bounds, palette, options.output(), options.outputImage(), options.forcedBPP(), options.backround(), options.literal(), options.verbose(), options.separateOutput() );
+      Decoded item{ i, std::nullopt, 0 };
+      try
+      {
+        if ( needsInput( *options[i] ) )
+        {
+          bool const streamed = entries[i].cost * sizeof( Color ) > memoryLimit;
+          item.bytes = streamed ? 0 : entries[i].cost * sizeof( Color );
+          budget.acquire( item.bytes );
+          item.image.emplace( options[i]->input(), streamed );
+        }
+      }
+      catch ( std::exception const& e )
+      {
+        entries[i].error = e.what();
+      }
+      decoded.push( std::move( item ) );
     }
+    decoded.close();
+  } };
+
+  PaletteCache palettes;
+  FileWriter writer{ 16 };
+  {
+    TaskGroup group;
+    while ( auto item = decoded.pop() )
+    {
+      group.run( [&, item = std::make_shared<Decoded>( std::move( *item ) )]
+      {
+        size_t const i = item->entry;
+        try
+        {
+          if ( entries[i].error.empty() )
+            pack( *options[i], item->image, palettes, writer, i );
+        }
+        catch ( std::exception const& e )
+        {
+          entries[i].error = e.what();
+        }
+
+        item->image.reset();
+        budget.release( item->bytes );
+      } );
+    }
+    group.wait();
+  }
+  decoder.join();
+
+  for ( auto const& [i, error] : writer.finish() )
+  {
+    if ( entries[i].error.empty() )
+      entries[i].error = error;
+  }
+
+  int failed = 0;
+  for ( auto const& entry : entries )
+  {
+    if ( entry.error.empty() )
+      continue;
+
+    std::cerr << path.string() << ":" << entry.line << ": " << entry.error;
+    if ( entry.error.back() != '\n' )
+      std::cerr << "\n";
+    failed += 1;
+  }
+
+  LOG << "\nPacked " << entries.size() - failed << " of " << entries.size() << " manifest entries with " << palettes.size() << " palettes";
+
+  return failed > 0 ? 1 : 0;
+}
+
+}
+
+int main( int argc, char const* argv[] )
+{
+  try
+  {
+    ProgramOptions options{ argc, argv };
+
+    Log::instance().verbose( options.verbose() );
+    ThreadPool::instance().threads( options.jobs() );
+
+    LOG << "Suzy Sprite Packer";
+
+    if ( options.manifest() )
+      return packManifest( *options.manifest(), options.memoryLimit() );
+
+    std::optional<Image> input;
+    if ( needsInput( options ) )
+      input.emplace( options.input(), Image::area( options.input() ) * sizeof( Color ) > options.memoryLimit() );
+
+    PaletteCache palettes;
+    FileWriter writer{ 16 };
+    pack( options, input, palettes, writer, 0 );
+
+    auto errors = writer.finish();
+    if ( !errors.empty() )
+      throw Ex{} << errors.front().second;
   }
   catch ( Ex const& e )
   {
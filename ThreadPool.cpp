@@ -0,0 +1,243 @@
+#include "ThreadPool.hpp"
+#include <algorithm>
+#include <optional>
+
+namespace
+{
+
+// queue of the worker running on this thread, none for threads outside of the pool
+thread_local size_t tQueue = ~size_t{};
+
+}
+
+ThreadPool::ThreadPool() : mQueues{}, mWorkers{}, mWorkerCount{}, mQueued{}, mMutex{}, mWake{}, mStop{}
+{
+  mQueues.push_back( std::make_unique<Queue>() );
+}
+
+ThreadPool::~ThreadPool()
+{
+  stop();
+}
+
+ThreadPool& ThreadPool::instance()
+{
+  static ThreadPool instance{};
+  return instance;
+}
+
+void ThreadPool::threads( int count )
+{
+  stop();
+
+  count = std::max( count, 1 );
+  mStop = false;
+  mQueues.clear();
+  for ( int i = 0; i < count; ++i )
+  {
+    mQueues.push_back( std::make_unique<Queue>() );
+  }
+
+  // workers read the count while others are being started
+  mWorkerCount = ( size_t )count - 1;
+
+  for ( int i = 1; i < count; ++i )
+  {
+    mWorkers.emplace_back( &ThreadPool::work, this, ( size_t )( i - 1 ) );
+  }
+}
+
+int ThreadPool::threads() const
+{
+  return ( int )mWorkerCount + 1;
+}
+
+void ThreadPool::stop()
+{
+  {
+    std::lock_guard<std::mutex> lock{ mMutex };
+    mStop = true;
+  }
+  mWake.notify_all();
+
+  for ( auto& worker : mWorkers )
+  {
+    worker.join();
+  }
+  mWorkers.clear();
+  mWorkerCount = 0;
+}
+
+void ThreadPool::submit( Task task )
+{
+  size_t const index = tQueue < mWorkerCount ? tQueue : mQueues.size() - 1;
+  {
+    std::lock_guard<std::mutex> lock{ mQueues[index]->mutex };
+    mQueues[index]->tasks.push_back( std::move( task ) );
+  }
+
+  mQueued += 1;
+  {
+    std::lock_guard<std::mutex> lock{ mMutex };
+  }
+  mWake.notify_one();
+}
+
+// Runs one task taken from the own queue or stolen from others, only a task of group if it is given, returns false if there was none
+bool ThreadPool::runOne( TaskGroup* group )
+{
+  size_t const own = tQueue < mWorkerCount ? tQueue : mQueues.size() - 1;
+  bool const worker = own < mWorkerCount;
+  auto const runnable = [group]( Task const& task )
+  {
+    return !group || task.group == group;
+  };
+
+  std::optional<Task> task;
+  for ( size_t i = 0; i < mQueues.size() && !task; ++i )
+  {
+    Queue& queue = *mQueues[( own + i ) % mQueues.size()];
+    std::lock_guard<std::mutex> lock{ queue.mutex };
+
+    if ( i == 0 && worker )
+    {
+      auto it = std::find_if( queue.tasks.rbegin(), queue.tasks.rend(), runnable );
+      if ( it == queue.tasks.rend() )
+        continue;
+
+      task = std::move( *it );
+      queue.tasks.erase( std::next( it ).base() );
+    }
+    else
+    {
+      auto it = std::find_if( queue.tasks.begin(), queue.tasks.end(), runnable );
+      if ( it == queue.tasks.end() )
+        continue;
+
+      task = std::move( *it );
+      queue.tasks.erase( it );
+    }
+  }
+
+  if ( !task )
+    return false;
+
+  mQueued -= 1;
+  task->group->mQueued -= 1;
+
+  std::exception_ptr error;
+  try
+  {
+    task->fun();
+  }
+  catch ( ... )
+  {
+    error = std::current_exception();
+  }
+  task->group->finish( error );
+
+  return true;
+}
+
+void ThreadPool::work( size_t index )
+{
+  tQueue = index;
+
+  for ( ;; )
+  {
+    if ( runOne() )
+      continue;
+
+    std::unique_lock<std::mutex> lock{ mMutex };
+    mWake.wait( lock, [this]
+    {
+      return mStop || mQueued > 0;
+    } );
+
+    if ( mStop )
+      return;
+  }
+}
+
+TaskGroup::TaskGroup() : mPool{ ThreadPool::instance() }, mPending{}, mQueued{}, mMutex{}, mDone{}, mError{}
+{
+}
+
+TaskGroup::~TaskGroup()
+{
+  try
+  {
+    wait();
+  }
+  catch ( ... )
+  {
+  }
+}
+
+void TaskGroup::run( std::function<void()> fun )
+{
+  mPending += 1;
+
+  if ( mPool.mWorkerCount == 0 )
+  {
+    std::exception_ptr error;
+    try
+    {
+      fun();
+    }
+    catch ( ... )
+    {
+      error = std::current_exception();
+    }
+    finish( error );
+  }
+  else
+  {
+    mQueued += 1;
+    mPool.submit( ThreadPool::Task{ std::move( fun ), this } );
+
+    // a waiter sleeping while other tasks of the group run can take this one
+    {
+      std::lock_guard<std::mutex> lock{ mMutex };
+    }
+    mDone.notify_all();
+  }
+}
+
+void TaskGroup::wait()
+{
+  // Only tasks of the group are run meanwhile. A task of another group could wait for something the caller holds, like a palette reduced
+  // inside std::call_once that waits for this group, and would never return on this thread
+  while ( mPending > 0 )
+  {
+    if ( mPool.runOne( this ) )
+      continue;
+
+    // tasks of the group are running on other threads, the last one to finish notifies
+    std::unique_lock<std::mutex> lock{ mMutex };
+    mDone.wait( lock, [this]
+    {
+      return mPending == 0 || mQueued > 0;
+    } );
+  }
+
+  std::exception_ptr error;
+  {
+    std::lock_guard<std::mutex> lock{ mMutex };
+    std::swap( error, mError );
+  }
+
+  if ( error )
+    std::rethrow_exception( error );
+}
+
+void TaskGroup::finish( std::exception_ptr error )
+{
+  // counted and notified under the lock, which the waiter takes before returning, so the group is not destroyed meanwhile
+  std::lock_guard<std::mutex> lock{ mMutex };
+  if ( error && !mError )
+    mError = error;
+
+  if ( --mPending == 0 )
+    mDone.notify_all();
+}
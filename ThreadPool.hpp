@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class TaskGroup;
+
+// Work stealing pool. Every worker runs the newest task of its own queue and steals the oldest tasks of the others,
+// threads outside of the pool queue their tasks to a shared queue. Waiting for a group runs queued tasks of the group meanwhile, so tasks may nest.
+class ThreadPool
+{
+public:
+  ~ThreadPool();
+
+  static ThreadPool& instance();
+
+  // number of threads running tasks including the waiting one, 1 runs every task inline
+  void threads( int count );
+  int threads() const;
+
+private:
+  friend class TaskGroup;
+
+  struct Task
+  {
+    std::function<void()> fun;
+    TaskGroup* group;
+  };
+
+  struct Queue
+  {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  ThreadPool();
+  void stop();
+  void submit( Task task );
+  bool runOne( TaskGroup* group = nullptr );
+  void work( size_t index );
+
+  // one queue per worker and the last one shared by other threads
+  std::vector<std::unique_ptr<Queue>> mQueues;
+  std::vector<std::thread> mWorkers;
+  size_t mWorkerCount;
+  std::atomic<size_t> mQueued;
+  std::mutex mMutex;
+  // wakes idle workers when tasks are submitted, waiters of groups are woken by their group
+  std::condition_variable mWake;
+  bool mStop;
+};
+
+// Tasks run on the pool that can be waited for together
+class TaskGroup
+{
+public:
+  TaskGroup();
+  ~TaskGroup();
+  TaskGroup( TaskGroup const& ) = delete;
+  TaskGroup& operator=( TaskGroup const& ) = delete;
+
+  void run( std::function<void()> fun );
+
+  // runs queued tasks of the group until all of them are finished, rethrows the first exception thrown by them
+  void wait();
+
+private:
+  friend class ThreadPool;
+
+  void finish( std::exception_ptr error );
+
+  ThreadPool& mPool;
+  std::atomic<size_t> mPending;
+  // tasks submitted to the pool and not taken by a thread yet
+  std::atomic<size_t> mQueued;
+  std::mutex mMutex;
+  // notified when the last task finishes and when a task is queued
+  std::condition_variable mDone;
+  std::exception_ptr mError;
+};
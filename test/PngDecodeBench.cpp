@@ -0,0 +1,133 @@
+#include "PngRowDecoder.hpp"
+#include "MappedFile.hpp"
+#include "lodepng.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <vector>
+
+// Decode throughput of PngRowDecoder and lodepng_decode32 over a corpus of PNG files, also checking both give the same pixels.
+// Usage: PngDecodeBench [-r repeats] files or directories searched for .png files
+
+namespace
+{
+
+double seconds( std::chrono::steady_clock::time_point start )
+{
+  return std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+}
+
+}
+
+int main( int argc, char* argv[] )
+{
+  int repeats = 3;
+  std::vector<std::filesystem::path> paths;
+  for ( int i = 1; i < argc; ++i )
+  {
+    if ( std::strcmp( argv[i], "-r" ) == 0 && i + 1 < argc )
+    {
+      repeats = std::max( 1, std::atoi( argv[++i] ) );
+    }
+    else if ( std::filesystem::is_directory( argv[i] ) )
+    {
+      for ( auto const& entry : std::filesystem::recursive_directory_iterator{ argv[i] } )
+      {
+        if ( entry.is_regular_file() && entry.path().extension() == ".png" )
+          paths.push_back( entry.path() );
+      }
+    }
+    else
+    {
+      paths.push_back( argv[i] );
+    }
+  }
+
+  if ( paths.empty() )
+  {
+    std::printf( "Usage: PngDecodeBench [-r repeats] files or directories searched for .png files\n" );
+    return 1;
+  }
+
+  std::sort( paths.begin(), paths.end() );
+
+  double rowSeconds = 0;
+  double lodeSeconds = 0;
+  uint64_t pixels = 0;
+  uint64_t fileBytes = 0;
+  int files = 0;
+  int failures = 0;
+
+  for ( auto const& path : paths )
+  {
+    try
+    {
+      MappedFile const file{ path };
+      PngRowDecoder const decoder{ file.data(), file.size() };
+      // interlaced images are decoded by lodepng anyway
+      if ( decoder.interlaced() )
+      {
+        std::printf( "%s: interlaced, skipped\n", path.string().c_str() );
+        continue;
+      }
+
+      size_t const rowBytes = ( size_t )decoder.width() * 4;
+      std::vector<uint8_t> rows( rowBytes * decoder.height() );
+      auto start = std::chrono::steady_clock::now();
+      for ( int r = 0; r < repeats; ++r )
+      {
+        decoder.decode( [&]( int y, std::span<Color const> row )
+        {
+          std::memcpy( rows.data() + y * rowBytes, row.data(), rowBytes );
+        } );
+      }
+      double const rowTime = seconds( start ) / repeats;
+
+      unsigned char* expected = nullptr;
+      start = std::chrono::steady_clock::now();
+      for ( int r = 0; r < repeats; ++r )
+      {
+        std::free( expected );
+        expected = nullptr;
+        unsigned width, height;
+        if ( unsigned error = lodepng_decode32( &expected, &width, &height, file.data(), file.size() ) )
+        {
+          std::printf( "%s: lodepng error %u: %s\n", path.string().c_str(), error, lodepng_error_text( error ) );
+          break;
+        }
+      }
+      double const lodeTime = seconds( start ) / repeats;
+
+      bool const same = expected && std::memcmp( rows.data(), expected, rows.size() ) == 0;
+      std::free( expected );
+      failures += same ? 0 : 1;
+
+      uint64_t const area = ( uint64_t )decoder.width() * decoder.height();
+      std::printf( "%s: %dx%d, %.1f ms, lodepng %.1f ms%s\n", path.string().c_str(), decoder.width(), decoder.height(), rowTime * 1000, lodeTime * 1000, same ? "" : ", PIXELS DIFFER" );
+
+      rowSeconds += rowTime;
+      lodeSeconds += lodeTime;
+      pixels += area;
+      fileBytes += file.size();
+      files += 1;
+    }
+    catch ( std::exception const& e )
+    {
+      std::printf( "%s: %s\n", path.string().c_str(), e.what() );
+      failures += 1;
+    }
+  }
+
+  if ( files > 0 )
+  {
+    double const megabytes = pixels * 4 / 1e6;
+    std::printf( "%d files, %.1f MB compressed, %.1f MB of RGBA pixels: PngRowDecoder %.1f MB/s, lodepng %.1f MB/s, %.2fx\n",
+      files, fileBytes / 1e6, megabytes, megabytes / rowSeconds, megabytes / lodeSeconds, lodeSeconds / rowSeconds );
+  }
+
+  return failures == 0 ? 0 : 1;
+}
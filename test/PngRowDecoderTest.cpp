@@ -0,0 +1,381 @@
+#include "PngRowDecoder.hpp"
+#include "lodepng.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Checks PngRowDecoder against lodepng_decode32 on images lodepng encodes in every color type and bit depth, with every row filter,
+// with stored, fixed and dynamic Huffman blocks and with the image data split over many IDAT chunks
+
+namespace
+{
+
+struct Format
+{
+  LodePNGColorType type;
+  unsigned bitDepth;
+};
+
+Format const FORMATS[] =
+{
+  { LCT_GREY, 1 }, { LCT_GREY, 2 }, { LCT_GREY, 4 }, { LCT_GREY, 8 }, { LCT_GREY, 16 },
+  { LCT_RGB, 8 }, { LCT_RGB, 16 },
+  { LCT_PALETTE, 1 }, { LCT_PALETTE, 2 }, { LCT_PALETTE, 4 }, { LCT_PALETTE, 8 },
+  { LCT_GREY_ALPHA, 8 }, { LCT_GREY_ALPHA, 16 },
+  { LCT_RGBA, 8 }, { LCT_RGBA, 16 }
+};
+
+// How a test image is encoded
+struct Encoding
+{
+  // 0 stored, 1 fixed and 2 dynamic Huffman codes
+  unsigned btype;
+  // filter type of every row
+  std::vector<uint8_t> filters;
+  unsigned windowSize;
+  // largest IDAT chunk, 0 keeps the image data in one chunk
+  size_t chunkSize;
+  // the image has a tRNS chunk, a color key or a palette with alpha
+  bool transparency;
+  // entries in PLTE, 0 picks a random size
+  unsigned paletteSize = 0;
+};
+
+std::string describe( Format format, Encoding const& encoding, unsigned width, unsigned height )
+{
+  return "color type " + std::to_string( format.type ) + ", " + std::to_string( format.bitDepth ) + " bits, " + std::to_string( width ) + "x" + std::to_string( height ) +
+    ", btype " + std::to_string( encoding.btype ) + ", window " + std::to_string( encoding.windowSize ) + ", IDAT chunks of " + std::to_string( encoding.chunkSize ) +
+    ( encoding.transparency ? ", transparent" : "" ) + ( encoding.paletteSize > 0 ? ", " + std::to_string( encoding.paletteSize ) + " palette entries" : "" );
+}
+
+// Raw image data in lodepng layout, rows are not padded to bytes. Noise, runs and copies of earlier data mix literals with short and far matches
+std::vector<uint8_t> rawImage( size_t size, std::mt19937& rng )
+{
+  std::vector<uint8_t> result;
+  result.reserve( size );
+  std::uniform_int_distribution<int> length{ 1, 300 };
+  while ( result.size() < size )
+  {
+    size_t const n = std::min<size_t>( length( rng ), size - result.size() );
+    switch ( rng() % 3 )
+    {
+    case 0:
+      for ( size_t i = 0; i < n; ++i )
+        result.push_back( ( uint8_t )rng() );
+      break;
+    case 1:
+      result.insert( result.end(), n, ( uint8_t )rng() );
+      break;
+    default:
+      if ( result.empty() )
+        break;
+      size_t const from = rng() % result.size();
+      for ( size_t i = 0; i < n; ++i )
+        result.push_back( result[from + i] );
+      break;
+    }
+  }
+  return result;
+}
+
+// contents of the IDAT chunks of a PNG, the zlib stream of its image data
+std::vector<uint8_t> imageData( std::vector<uint8_t> const& png )
+{
+  std::vector<uint8_t> result;
+  for ( uint8_t const* chunk = png.data() + 8; chunk < png.data() + png.size(); chunk = lodepng_chunk_next_const( chunk ) )
+  {
+    if ( lodepng_chunk_type_equals( chunk, "IDAT" ) )
+    {
+      uint8_t const* data = lodepng_chunk_data_const( chunk );
+      result.insert( result.end(), data, data + lodepng_chunk_length( chunk ) );
+    }
+  }
+  return result;
+}
+
+// Replaces the IDAT chunks of a PNG with chunks of at most chunkSize bytes of idat, some of them empty, or with one chunk if chunkSize is 0
+std::vector<uint8_t> replaceImageData( std::vector<uint8_t> const& png, std::vector<uint8_t> const& idat, size_t chunkSize, std::mt19937& rng )
+{
+  // chunks are appended to the signature
+  size_t outSize = 8;
+  unsigned char* out = ( unsigned char* )std::malloc( outSize );
+  std::memcpy( out, png.data(), outSize );
+  unsigned error = 0;
+  bool written = false;
+  for ( uint8_t const* chunk = png.data() + 8; chunk < png.data() + png.size(); chunk = lodepng_chunk_next_const( chunk ) )
+  {
+    if ( !lodepng_chunk_type_equals( chunk, "IDAT" ) )
+    {
+      error = error ? error : lodepng_chunk_append( &out, &outSize, chunk );
+    }
+    else if ( !written )
+    {
+      written = true;
+      for ( size_t pos = 0; pos < idat.size(); )
+      {
+        size_t const size = chunkSize > 0 ? std::min( idat.size() - pos, rng() % ( chunkSize + 1 ) ) : idat.size();
+        error = error ? error : lodepng_chunk_create( &out, &outSize, ( unsigned )size, "IDAT", idat.data() + pos );
+        pos += size;
+      }
+    }
+  }
+
+  std::vector<uint8_t> const result( out, out + outSize );
+  std::free( out );
+  if ( error )
+    throw std::runtime_error{ lodepng_error_text( error ) };
+  return result;
+}
+
+std::vector<uint8_t> encode( Format format, Encoding const& encoding, unsigned width, unsigned height, std::vector<uint8_t> const& raw, std::mt19937& rng )
+{
+  LodePNGState state;
+  lodepng_state_init( &state );
+  state.info_raw.colortype = state.info_png.color.colortype = format.type;
+  state.info_raw.bitdepth = state.info_png.color.bitdepth = format.bitDepth;
+
+  if ( format.type == LCT_PALETTE )
+  {
+    // a palette shorter than the indices leaves some pixels past it
+    unsigned const size = encoding.paletteSize > 0 ? encoding.paletteSize : 1 + rng() % ( 1u << format.bitDepth );
+    for ( unsigned i = 0; i < size; ++i )
+    {
+      unsigned char const r = ( unsigned char )rng(), g = ( unsigned char )rng(), b = ( unsigned char )rng();
+      unsigned char const a = encoding.transparency ? ( unsigned char )rng() : 255;
+      lodepng_palette_add( &state.info_png.color, r, g, b, a );
+      lodepng_palette_add( &state.info_raw, r, g, b, a );
+    }
+  }
+  else if ( encoding.transparency && ( format.type == LCT_GREY || format.type == LCT_RGB ) )
+  {
+    // the key is the first pixel, so some pixels match it
+    unsigned const channels = format.type == LCT_RGB ? 3 : 1;
+    unsigned key[3] = {};
+    for ( unsigned c = 0; c < channels; ++c )
+    {
+      key[c] = format.bitDepth == 16 ? raw[c * 2] << 8 | raw[c * 2 + 1] : format.bitDepth == 8 ? raw[c] : raw[0] >> ( 8 - format.bitDepth );
+    }
+    for ( LodePNGColorMode* mode : { &state.info_png.color, &state.info_raw } )
+    {
+      mode->key_defined = 1;
+      mode->key_r = key[0];
+      mode->key_g = channels == 3 ? key[1] : key[0];
+      mode->key_b = channels == 3 ? key[2] : key[0];
+    }
+  }
+
+  state.encoder.auto_convert = 0;
+  state.encoder.filter_palette_zero = 0;
+  state.encoder.filter_strategy = LFS_PREDEFINED;
+  state.encoder.predefined_filters = encoding.filters.data();
+  state.encoder.zlibsettings.btype = encoding.btype;
+  state.encoder.zlibsettings.windowsize = encoding.windowSize;
+  state.encoder.zlibsettings.nicematch = 258;
+
+  unsigned char* png = nullptr;
+  size_t pngSize = 0;
+  unsigned const error = lodepng_encode( &png, &pngSize, raw.data(), width, height, &state );
+  lodepng_state_cleanup( &state );
+  std::vector<uint8_t> result( png, png + pngSize );
+  std::free( png );
+  if ( error )
+    throw std::runtime_error{ lodepng_error_text( error ) };
+
+  return encoding.chunkSize > 0 ? replaceImageData( result, imageData( result ), encoding.chunkSize, rng ) : result;
+}
+
+struct Totals
+{
+  size_t images = 0;
+  size_t failures = 0;
+};
+
+void check( Format format, Encoding const& encoding, unsigned width, unsigned height, std::vector<uint8_t> const& raw, std::mt19937& rng, Totals& totals )
+{
+  totals.images += 1;
+  auto fail = [&]( std::string const& what )
+  {
+    totals.failures += 1;
+    std::printf( "FAIL %s: %s\n", describe( format, encoding, width, height ).c_str(), what.c_str() );
+  };
+
+  std::vector<uint8_t> png;
+  unsigned char* expected = nullptr;
+  try
+  {
+    png = encode( format, encoding, width, height, raw, rng );
+    unsigned w, h;
+    if ( unsigned error = lodepng_decode32( &expected, &w, &h, png.data(), png.size() ) )
+      throw std::runtime_error{ lodepng_error_text( error ) };
+  }
+  catch ( std::exception const& e )
+  {
+    std::free( expected );
+    fail( std::string{ "lodepng: " } + e.what() );
+    return;
+  }
+
+  try
+  {
+    PngRowDecoder const decoder{ png.data(), png.size() };
+    if ( decoder.width() != ( int )width || decoder.height() != ( int )height || decoder.interlaced() || decoder.indexed() != ( format.type == LCT_PALETTE ) )
+      fail( "header differs" );
+
+    int rows = 0;
+    bool same = true;
+    decoder.decode( [&]( int y, std::span<Color const> row )
+    {
+      same = same && y == rows++ && row.size() == width && std::memcmp( row.data(), expected + ( size_t )y * width * 4, width * 4 ) == 0;
+    } );
+    if ( !same || rows != ( int )height )
+      fail( "pixels differ from lodepng_decode32" );
+
+    if ( decoder.indexed() )
+    {
+      // indices are the raw image data lodepng encoded, packed from the most significant bits without padding rows
+      unsigned const bits = format.bitDepth;
+      rows = 0;
+      same = true;
+      decoder.decodeIndices( [&]( int y, std::span<uint8_t const> row )
+      {
+        same = same && y == rows++ && row.size() == width;
+        for ( unsigned x = 0; same && x < width; ++x )
+        {
+          size_t const bit = ( ( size_t )y * width + x ) * bits;
+          same = row[x] == ( raw[bit / 8] >> ( 8 - bits - bit % 8 ) & ( ( 1u << bits ) - 1 ) );
+        }
+      } );
+      if ( !same || rows != ( int )height )
+        fail( "indices differ from the encoded image" );
+
+      // every index, in or past the palette, gives the color lodepng decodes it to
+      std::vector<Color> const palette = decoder.palette();
+      for ( size_t i = 0; same && i < ( size_t )width * height; ++i )
+      {
+        size_t const bit = i * bits;
+        Color const color = palette[raw[bit / 8] >> ( 8 - bits - bit % 8 ) & ( ( 1u << bits ) - 1 )];
+        same = std::memcmp( &color, expected + i * 4, 4 ) == 0;
+      }
+      if ( !same )
+        fail( "palette differs from lodepng_decode32" );
+    }
+  }
+  catch ( std::exception const& e )
+  {
+    fail( std::string{ "PngRowDecoder: " } + e.what() );
+  }
+
+  std::free( expected );
+}
+
+void check( Format format, Encoding const& encoding, unsigned width, unsigned height, std::mt19937& rng, Totals& totals )
+{
+  LodePNGColorMode mode;
+  lodepng_color_mode_init( &mode );
+  mode.colortype = format.type;
+  mode.bitdepth = format.bitDepth;
+  check( format, encoding, width, height, rawImage( lodepng_get_raw_size( width, height, &mode ), rng ), rng, totals );
+}
+
+// Indices past the end of PLTE are an error by the PNG specification, lodepng decodes them as opaque black rather than failing,
+// so every row holds every index of the bit depth against a palette of two entries, or one at 1 bit
+void checkPastPalette( std::mt19937& rng, Totals& totals )
+{
+  for ( unsigned bits : { 1u, 2u, 4u, 8u } )
+  {
+    unsigned const width = 1u << bits, height = 5;
+    std::vector<uint8_t> raw( ( width * height * bits + 7 ) / 8 );
+    for ( size_t i = 0; i < ( size_t )width * height; ++i )
+    {
+      size_t const bit = i * bits;
+      raw[bit / 8] |= ( uint8_t )( i % width << ( 8 - bits - bit % 8 ) );
+    }
+
+    Encoding encoding{ 2, { 0, 1, 2, 3, 4 }, 32768, 0, true, bits == 1 ? 1u : 2u };
+    check( Format{ LCT_PALETTE, bits }, encoding, width, height, raw, rng, totals );
+  }
+}
+
+// Damaged image data must throw rather than give pixels
+void checkDamaged( std::mt19937& rng, Totals& totals )
+{
+  Format const format{ LCT_RGBA, 8 };
+  Encoding const encoding{ 2, std::vector<uint8_t>( 64, 4 ), 32768, 0, false };
+  std::vector<uint8_t> const png = encode( format, encoding, 64, 64, rawImage( 64 * 64 * 4, rng ), rng );
+
+  auto expectThrow = [&]( std::vector<uint8_t> const& data, char const* what )
+  {
+    totals.images += 1;
+    try
+    {
+      PngRowDecoder const decoder{ data.data(), data.size() };
+      decoder.decode( []( int, std::span<Color const> )
+      {
+      } );
+      totals.failures += 1;
+      std::printf( "FAIL %s decoded without an error\n", what );
+    }
+    catch ( std::exception const& )
+    {
+    }
+  };
+
+  std::vector<uint8_t> idat = imageData( png );
+  idat.back() ^= 1;
+  expectThrow( replaceImageData( png, idat, 0, rng ), "image with an Adler-32 checksum mismatch" );
+
+  // the first byte of image data follows the 8 byte signature, the 25 byte IHDR chunk and the IDAT length and type
+  std::vector<uint8_t> damaged = png;
+  damaged[8 + 25 + 8] ^= 1;
+  expectThrow( damaged, "image with a chunk CRC mismatch" );
+
+  std::vector<uint8_t> const truncated( png.begin(), png.begin() + png.size() / 2 );
+  expectThrow( truncated, "truncated image" );
+}
+
+}
+
+int main()
+{
+  std::mt19937 rng{ 12345 };
+  Totals totals;
+
+  // widths around the 16 and 32 byte registers and their tails
+  unsigned const widths[] = { 1, 2, 3, 5, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 65, 100 };
+
+  for ( Format format : FORMATS )
+  {
+    for ( unsigned btype = 0; btype < 3; ++btype )
+    {
+      for ( unsigned width : widths )
+      {
+        unsigned const height = 1 + rng() % 24;
+        Encoding encoding{ btype, std::vector<uint8_t>( height ), 1u << ( 8 + rng() % 8 ), 0, rng() % 2 == 0 };
+        for ( uint8_t& filter : encoding.filters )
+          filter = ( uint8_t )( rng() % 5 );
+        // one chunk, chunks of a few bytes or chunks of up to a few hundred bytes
+        size_t const chunkSizes[] = { 0, 7, 300 };
+        encoding.chunkSize = chunkSizes[rng() % 3];
+        check( format, encoding, width, height, rng, totals );
+      }
+
+      // images larger than the inflate window and output buffer, with every filter on consecutive rows
+      unsigned const width = 700, height = 120;
+      Encoding encoding{ btype, std::vector<uint8_t>( height ), 32768, 5000, true };
+      for ( unsigned y = 0; y < height; ++y )
+        encoding.filters[y] = ( uint8_t )( y % 5 );
+      check( format, encoding, width, height, rng, totals );
+    }
+  }
+
+  checkPastPalette( rng, totals );
+  checkDamaged( rng, totals );
+
+  std::printf( "%zu images, %zu failures\n", totals.images, totals.failures );
+  return totals.failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,449 @@
+#include "SpriteRow.hpp"
+#include <cstdio>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+// Checks SpriteRow::packed against the windowed permutation search it replaced: the dynamic program must never give a longer row
+// and every row, packed or literal, must decode back to its pens
+
+namespace
+{
+
+// The previous packer, kept as written apart from taking pens instead of an image row and assembling bits one byte at a time
+class ReferencePacker
+{
+  struct Cmd
+  {
+    bool rle;
+    int off;
+    int size;
+  };
+
+  std::vector<Cmd> cmds;
+  std::vector<uint8_t> pens;
+
+  class Bits
+  {
+    std::vector<uint8_t> buffer;
+    int accum;
+    int size;
+  public:
+
+    Bits() : buffer{}, accum{}, size{}
+    {
+    }
+
+    void shift( int bits, int value )
+    {
+      while ( bits > 0 )
+      {
+        if ( size + bits >= 8 )
+        {
+          accum <<= 8 - size;
+          accum |= value >> ( bits - 8 + size );
+          value &= ( 1 << ( bits - 8 + size ) ) - 1;
+          bits -= 8 - size;
+          buffer.push_back( ( uint8_t )accum );
+          accum = size = 0;
+        }
+        else
+        {
+          accum <<= bits;
+          accum |= value;
+          size += bits;
+          break;
+        }
+      }
+    }
+
+    std::vector<uint8_t> flushRow()
+    {
+      if ( size > 0 )
+      {
+        accum <<= 8 - size;
+        buffer.push_back( ( uint8_t )accum );
+        accum = size = 0;
+      }
+      else
+      {
+        buffer.push_back( 0 );
+      }
+      return std::move( buffer );
+    }
+  };
+
+  void tokenize()
+  {
+    int streak{};
+    bool rle{};
+    for ( size_t i = 0; i < pens.size(); ++i, ++streak )
+    {
+      switch ( streak )
+      {
+      case 0:
+        rle = false;
+        break;
+      case 1:
+        rle = pens[i - 1] == pens[i];
+        break;
+      default:
+        if ( ( pens[i - 1] == pens[i] ) ^ rle )
+        {
+          Cmd cmd{ rle, ( int )( i - streak ), streak - ( rle ? 0 : 1 ) };
+          cmds.push_back( cmd );
+          streak = rle ? 0 : 1;
+          rle = !rle;
+        }
+        break;
+      }
+    }
+    if ( cmds.empty() || cmds.back().off + cmds.back().size < ( int )pens.size() )
+    {
+      Cmd cmd{ rle, ( int )( pens.size() - streak ), streak };
+      cmds.push_back( cmd );
+    }
+  }
+
+  Cmd optimize( int off, Cmd const* beg, Cmd const* end )
+  {
+    uint32_t optScore = ~0;
+    uint32_t optPerm = 0;
+
+    auto size = [off]( Cmd const* it )
+    {
+      int result = it->size - std::max( off - it->off, 0 );
+      result = std::min( result, 16 );
+      return result;
+    };
+
+    for ( int perm = 0;; ++perm )
+    {
+      bool literal = false;
+      int idx = 0;
+      uint32_t score = 0;
+
+      for ( auto it = beg; it != end; ++it )
+      {
+        if ( it->rle )
+        {
+          if ( ( perm & ( 1 << idx++ ) ) == 0 )
+          {
+            if ( literal )
+            {
+              score += size( it ) * 4;
+            }
+            else
+            {
+              literal = true;
+              score += 4 + 1 + size( it ) * 4;
+            }
+          }
+          else
+          {
+            score += 9;
+            literal = false;
+          }
+        }
+        else
+        {
+          if ( literal )
+          {
+            score += size( it ) * 4;
+          }
+          else
+          {
+            literal = true;
+            score += 4 + 1 + size( it ) * 4;
+          }
+        }
+      }
+
+      if ( score < optScore )
+      {
+        optScore = score;
+        optPerm = perm;
+      }
+
+      if ( perm >= ( 1 << idx ) - 1 )
+        break;
+    }
+
+    Cmd cmd{ false, off, 0 };
+
+    int idx = 0;
+    bool literal = false;
+    for ( auto it = beg; it != end; ++it )
+    {
+      if ( it->rle && ( optPerm & ( 1 << idx++ ) ) != 0 )
+      {
+        if ( literal )
+        {
+          return cmd;
+        }
+        cmd.rle = true;
+        cmd.size = size( it );
+        return cmd;
+      }
+      else
+      {
+        literal = true;
+        cmd.size += size( it );
+        if ( cmd.size >= 16 )
+        {
+          cmd.size = 16;
+          return cmd;
+        }
+      }
+    }
+
+    return cmd;
+  }
+
+  void optimize()
+  {
+    std::vector<Cmd> result;
+
+    int off = 0;
+    for ( auto it = cmds.cbegin(); it < cmds.cend(); )
+    {
+      for ( auto jt = it; jt < cmds.cend(); ++jt )
+      {
+        if ( jt + 1 == cmds.cend() || jt->off - off >= 16 )
+        {
+          Cmd cmd = optimize( off, &*it, &*jt + ( jt + 1 == cmds.cend() ? 1 : 0 ) );
+          off += cmd.size;
+          result.push_back( cmd );
+
+          for ( ; it < cmds.cend(); ++it )
+          {
+            if ( it->off + it->size > off )
+            {
+              break;
+            }
+          }
+          break;
+        }
+      }
+    }
+
+    std::swap( cmds, result );
+  }
+
+public:
+
+  static std::vector<uint8_t> packed( int bpp, std::vector<uint8_t> const& pens )
+  {
+    ReferencePacker packer;
+    packer.pens = pens;
+    packer.tokenize();
+    packer.optimize();
+
+    Bits result;
+    for ( Cmd cmd : packer.cmds )
+    {
+      result.shift( 1, cmd.rle ? 0 : 1 );
+      result.shift( 4, cmd.size - 1 );
+      if ( cmd.rle )
+      {
+        result.shift( bpp, pens[cmd.off] );
+      }
+      else
+      {
+        for ( int i = cmd.off; i < cmd.off + cmd.size; ++i )
+        {
+          result.shift( bpp, pens[i] );
+        }
+      }
+    }
+
+    return result.flushRow();
+  }
+};
+
+class BitReader
+{
+  std::vector<uint8_t> const& mData;
+  size_t mBit;
+public:
+
+  BitReader( std::vector<uint8_t> const& data ) : mData{ data }, mBit{}
+  {
+  }
+
+  // false once the data is exhausted
+  bool read( int bits, int& value )
+  {
+    if ( mBit + bits > mData.size() * 8 )
+      return false;
+
+    value = 0;
+    for ( int i = 0; i < bits; ++i, ++mBit )
+    {
+      value = ( value << 1 ) | ( ( mData[mBit / 8] >> ( 7 - mBit % 8 ) ) & 1 );
+    }
+    return true;
+  }
+
+  size_t position() const
+  {
+    return mBit;
+  }
+};
+
+// Decodes width pens of a packed row, nullopt if the packets are malformed or followed by more than the padding the hardware needs.
+// Suzy ends the row at a header of 00000, so one before the last pen truncates the row
+std::optional<std::vector<uint8_t>> decodePacked( int bpp, std::vector<uint8_t> const& data, size_t width )
+{
+  std::vector<uint8_t> pens;
+  BitReader reader{ data };
+  while ( pens.size() < width )
+  {
+    int header, pen;
+    if ( !reader.read( 5, header ) || header == 0 )
+      return std::nullopt;
+
+    int const count = ( header & 0xf ) + 1;
+    for ( int i = 0; i < count; ++i )
+    {
+      if ( ( i == 0 || ( header & 0x10 ) ) && !reader.read( bpp, pen ) )
+        return std::nullopt;
+      pens.push_back( ( uint8_t )pen );
+    }
+  }
+
+  // the last meaningful bit may not be bit 0 of a byte, so a row ending on a byte boundary carries one more byte
+  if ( pens.size() != width || data.size() != reader.position() / 8 + 1 )
+    return std::nullopt;
+
+  return pens;
+}
+
+std::vector<uint8_t> decodeLiteral( int bpp, std::vector<uint8_t> const& data, size_t width )
+{
+  std::vector<uint8_t> pens;
+  BitReader reader{ data };
+  int pen;
+  while ( pens.size() < width && reader.read( bpp, pen ) )
+  {
+    pens.push_back( ( uint8_t )pen );
+  }
+  return pens;
+}
+
+struct Totals
+{
+  size_t rows = 0;
+  size_t failures = 0;
+  size_t packedBytes = 0;
+  size_t referenceBytes = 0;
+};
+
+template<int bpp>
+void checkRow( std::string const& name, std::vector<uint8_t> const& pens, Totals& totals )
+{
+  SpriteRow const packedRow = SpriteRow::packed<bpp>( pens );
+  SpriteRow const literalRow = SpriteRow::literal<bpp>( pens );
+  std::vector<uint8_t> const packed{ packedRow.begin(), packedRow.end() };
+  std::vector<uint8_t> const literal{ literalRow.begin(), literalRow.end() };
+  std::vector<uint8_t> const reference = ReferencePacker::packed( bpp, pens );
+
+  totals.rows += 1;
+  totals.packedBytes += packed.size();
+  totals.referenceBytes += reference.size();
+
+  auto fail = [&]( char const* what )
+  {
+    totals.failures += 1;
+    std::printf( "FAIL %s, %d bpp, %zu pens: %s\n", name.c_str(), bpp, pens.size(), what );
+  };
+
+  if ( packed.size() > reference.size() )
+    fail( "packed row longer than the reference packer" );
+  if ( decodePacked( bpp, packed, pens.size() ) != pens )
+    fail( "packed row does not decode to its pens" );
+  if ( decodePacked( bpp, reference, pens.size() ) != pens )
+    fail( "reference row does not decode to its pens" );
+  if ( literal.size() != ( pens.size() * bpp + 7 ) / 8 || decodeLiteral( bpp, literal, pens.size() ) != pens )
+    fail( "literal row does not decode to its pens" );
+}
+
+template<int bpp>
+void checkRows( std::mt19937& rng, Totals& totals )
+{
+  int const pens = 1 << bpp;
+  auto pen = [&]( int limit )
+  {
+    return ( uint8_t )std::uniform_int_distribution<int>{ 0, std::min( limit, pens ) - 1 }( rng );
+  };
+
+  // single pens next to runs, which a 1 pixel RLE packet would encode as the end of row header
+  checkRow<bpp>( "single pen before a run", { 1, 0, 0, 0, 0 }, totals );
+  checkRow<bpp>( "single pen after a run", { 0, 0, 0, 0, 1 }, totals );
+  checkRow<bpp>( "single pen", { 0 }, totals );
+
+  // adversarial rows: run lengths around the 16 pixel packet limit, alternations and runs of two that the old search tokenized poorly
+  for ( int width = 1; width <= 40; ++width )
+  {
+    std::vector<uint8_t> same( width, ( uint8_t )( pens - 1 ) );
+    checkRow<bpp>( "uniform", same, totals );
+
+    std::vector<uint8_t> alternating( width );
+    for ( int i = 0; i < width; ++i )
+      alternating[i] = ( uint8_t )( i & 1 );
+    checkRow<bpp>( "alternating", alternating, totals );
+
+    for ( int run = 2; run <= 18; ++run )
+    {
+      std::vector<uint8_t> runs( width );
+      for ( int i = 0; i < width; ++i )
+        runs[i] = ( uint8_t )( ( i / run ) % pens );
+      checkRow<bpp>( "runs of " + std::to_string( run ), runs, totals );
+
+      std::vector<uint8_t> islands( width );
+      for ( int i = 0; i < width; ++i )
+        islands[i] = ( uint8_t )( i % run == 0 ? pens - 1 : 0 );
+      checkRow<bpp>( "single pens every " + std::to_string( run ), islands, totals );
+    }
+  }
+
+  // random rows of uniform pens, of few pens and of random run lengths
+  for ( int i = 0; i < 2000; ++i )
+  {
+    int const width = std::uniform_int_distribution<int>{ 1, 400 }( rng );
+    std::vector<uint8_t> row;
+    switch ( i % 3 )
+    {
+    case 0:
+      while ( ( int )row.size() < width )
+        row.push_back( pen( pens ) );
+      break;
+    case 1:
+      while ( ( int )row.size() < width )
+        row.push_back( pen( 2 ) );
+      break;
+    default:
+      while ( ( int )row.size() < width )
+        row.insert( row.end(), std::min( width - ( int )row.size(), std::uniform_int_distribution<int>{ 1, 24 }( rng ) ), pen( pens ) );
+      break;
+    }
+    checkRow<bpp>( "random", row, totals );
+  }
+}
+
+}
+
+int main()
+{
+  std::mt19937 rng{ 12345 };
+  Totals totals;
+
+  checkRows<1>( rng, totals );
+  checkRows<2>( rng, totals );
+  checkRows<3>( rng, totals );
+  checkRows<4>( rng, totals );
+
+  std::printf( "%zu rows, %zu failures, packed %zu bytes, reference %zu bytes\n", totals.rows, totals.failures, totals.packedBytes, totals.referenceBytes );
+  return totals.failures == 0 ? 0 : 1;
+}